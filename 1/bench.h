@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Helpers for the benchmarks: each scenario is run several times
+ * and reported as min, med and max of the runs.
+ */
+
+/** Runs of each scenario. */
+enum { BENCH_RUN_COUNT = 5 };
+
+static inline long long
+bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+bench_double_cmp(const void *a, const void *b) {
+  double l = *(const double *)a;
+  double r = *(const double *)b;
+  return (l > r) - (l < r);
+}
+
+/** Print min, med and max of the samples. They get sorted. */
+static inline void
+bench_report(const char *scenario, double *samples, int count,
+             const char *unit) {
+  qsort(samples, count, sizeof(*samples), bench_double_cmp);
+  printf("%s\n", scenario);
+  printf("    min: %.2f %s\n", samples[0], unit);
+  printf("    med: %.2f %s\n", samples[count / 2], unit);
+  printf("    max: %.2f %s\n", samples[count - 1], unit);
+}
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "libcoro.h"
+
+/**
+ * Benchmark of the coroutine runtime itself: context switch cost,
+ * coroutine creation and deletion cost, and how the scheduler
+ * scales with the coroutine count. The switch and the scaling are
+ * measured with own stacks and with the shared stack.
+ */
+
+/** Yields of each of the 2 ping-pong coroutines per run. */
+static const long long yield_count = 1000000;
+/** Coroutines created and deleted per run. */
+static const int new_delete_count = 10000;
+/** Yields of each coroutine in the scaling runs. */
+static const int scale_yield_count = 10;
+/** Stack size for the scaling runs, small to fit 100k coroutines. */
+static const size_t scale_stack_size = 16 * 1024;
+/** Size of the shared stack, it is only one. */
+static const size_t shared_stack_size = 1024 * 1024;
+static const int scale_counts[] = {10, 1000, 100000};
+
+static int
+ping_pong_f(void *arg) {
+  (void)arg;
+  for (long long i = 0; i < yield_count; ++i)
+    coro_yield();
+  return 0;
+}
+
+static int
+empty_f(void *arg) {
+  (void)arg;
+  return 0;
+}
+
+static int
+yielder_f(void *arg) {
+  (void)arg;
+  for (int i = 0; i < scale_yield_count; ++i)
+    coro_yield();
+  return 0;
+}
+
+/** Reap all the coroutines, return how many were there. */
+static int
+reap_all(void) {
+  int count = 0;
+  struct coro *c;
+  while ((c = coro_sched_wait()) != NULL) {
+    coro_delete(c);
+    ++count;
+  }
+  return count;
+}
+
+/** Nanoseconds per coro_yield() with 2 coroutines switching. */
+static double
+bench_ping_pong(void) {
+  coro_new(ping_pong_f, NULL, 0);
+  coro_new(ping_pong_f, NULL, 0);
+  long long start = bench_now_ns();
+  reap_all();
+  return (double)(bench_now_ns() - start) / (2 * yield_count);
+}
+
+/**
+ * Nanoseconds per coro_new() + coro_delete(). The coroutines are
+ * run in between, that is not counted.
+ */
+static double
+bench_new_delete(struct coro **coros) {
+  long long start = bench_now_ns();
+  for (int i = 0; i < new_delete_count; ++i)
+    coro_new(empty_f, NULL, 0);
+  long long duration = bench_now_ns() - start;
+  int count = 0;
+  struct coro *c;
+  while ((c = coro_sched_wait()) != NULL)
+    coros[count++] = c;
+  start = bench_now_ns();
+  for (int i = 0; i < count; ++i)
+    coro_delete(coros[i]);
+  duration += bench_now_ns() - start;
+  return (double)duration / new_delete_count;
+}
+
+/**
+ * Nanoseconds per coroutine lifetime in a crowd: created, yielded a
+ * few times among all the others, reaped by coro_sched_wait() and
+ * deleted.
+ */
+static double
+bench_scale(int count) {
+  long long start = bench_now_ns();
+  for (int i = 0; i < count; ++i) {
+    if (coro_new(yielder_f, NULL, 0) == NULL) {
+      perror("coro_new");
+      exit(1);
+    }
+  }
+  reap_all();
+  return (double)(bench_now_ns() - start) / count;
+}
+
+/**
+ * Print the memory per coroutine, while @a count of them are alive
+ * and each has run. Must go before the other runs, so as no stacks
+ * are cached yet.
+ */
+static void
+report_stack_memory(int count, const char *stack_mode) {
+  struct coro_stack_stat before;
+  coro_stack_stat(&before);
+  for (int i = 0; i < count; ++i)
+    coro_new(yielder_f, NULL, 0);
+  /* The first one finishes after all the others have yielded. */
+  struct coro *first = coro_sched_wait();
+  struct coro_stack_stat stat;
+  coro_stack_stat(&stat);
+  coro_delete(first);
+  reap_all();
+  printf("Memory per coroutine, %d coroutines, %s\n", count, stack_mode);
+  printf("    stack mapped: %zu bytes\n",
+         (stat.mapped_size - before.mapped_size) / count);
+  printf("    stack saved: %zu bytes\n", stat.saved_size / count);
+  printf("    RSS: %zu bytes\n", (stat.rss - before.rss) / count);
+}
+
+/** The scaling scenarios with the current stack settings. */
+static void
+bench_scale_all(const char *stack_mode) {
+  double samples[BENCH_RUN_COUNT];
+  report_stack_memory(scale_counts[2], stack_mode);
+  for (size_t i = 0; i < sizeof(scale_counts) / sizeof(scale_counts[0]); ++i) {
+    int count = scale_counts[i];
+    bench_scale(count);
+    for (int run = 0; run < BENCH_RUN_COUNT; ++run)
+      samples[run] = bench_scale(count);
+    char name[128];
+    snprintf(name, sizeof(name),
+             "coro_sched_wait, %d coroutines, %d yields each, %s", count,
+             scale_yield_count, stack_mode);
+    bench_report(name, samples, BENCH_RUN_COUNT, "ns/coroutine");
+  }
+}
+
+int main(void) {
+  coro_sched_init();
+  double samples[BENCH_RUN_COUNT];
+
+  /* A run to warm up the stack cache. */
+  bench_ping_pong();
+  for (int run = 0; run < BENCH_RUN_COUNT; ++run)
+    samples[run] = bench_ping_pong();
+  bench_report("coro_yield ping-pong", samples, BENCH_RUN_COUNT, "ns/yield");
+
+  struct coro **coros = malloc(new_delete_count * sizeof(*coros));
+  bench_new_delete(coros);
+  for (int run = 0; run < BENCH_RUN_COUNT; ++run)
+    samples[run] = bench_new_delete(coros);
+  bench_report("coro_new + coro_delete", samples, BENCH_RUN_COUNT, "ns/pair");
+  free(coros);
+
+  coro_sched_set_stack_size(scale_stack_size);
+  coro_sched_set_stack_guard(false);
+  bench_scale_all("16KB stacks");
+
+  coro_sched_set_stack_size(shared_stack_size);
+  if (coro_sched_set_shared_stack(true) != 0) {
+    perror("Shared stack is not available");
+    coro_sched_destroy();
+    return 0;
+  }
+  for (int run = 0; run < BENCH_RUN_COUNT; ++run)
+    samples[run] = bench_ping_pong();
+  bench_report("coro_yield ping-pong, shared stack", samples,
+               BENCH_RUN_COUNT, "ns/yield");
+  bench_scale_all("shared stack");
+  coro_sched_destroy();
+  return 0;
+}
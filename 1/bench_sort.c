@@ -0,0 +1,189 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "intio.h"
+#include "libcoro.h"
+#include "mergesort.h"
+#include "radixsort.h"
+
+/**
+ * Sort benchmark on generator.py files. Each scenario sorts a fresh
+ * copy of every file and reports the time per element. With -n only
+ * that many first numbers of each file are sorted, to see how the
+ * sorts compare on small arrays.
+ */
+
+/** The sort as it was: malloc per level, byte-wise copies. */
+static int
+mergesort_baseline(void *array, size_t elements, size_t element_size,
+                   int (*comparator)(const void *, const void *)) {
+  if (elements <= 1)
+    return 0;
+  size_t middle = elements / 2;
+  void *left = array;
+  void *right = (char *)array + middle * element_size;
+  if (mergesort_baseline(left, middle, element_size, comparator) != 0 ||
+      mergesort_baseline(right, elements - middle, element_size,
+                         comparator) != 0)
+    return -1;
+  void *temp = malloc(elements * element_size);
+  if (temp == NULL)
+    return -1;
+  merge(left, right, middle, elements - middle, element_size, comparator,
+        temp);
+  my_memcpy(array, temp, elements * element_size);
+  free(temp);
+  return 0;
+}
+
+/**
+ * A comparator mergesort() knows nothing about. Same as
+ * mergesort_int_comparator(), but it takes the generic path.
+ */
+static int
+int_generic_comparator(const void *a, const void *b) {
+  int l = *(const int *)a;
+  int r = *(const int *)b;
+  return (l > r) - (l < r);
+}
+
+static int
+sort_baseline(int *data, size_t size) {
+  return mergesort_baseline(data, size, sizeof(int), int_generic_comparator);
+}
+
+static int
+sort_generic(int *data, size_t size) {
+  return mergesort(data, size, sizeof(int), int_generic_comparator);
+}
+
+static int
+sort_specialized(int *data, size_t size) {
+  return mergesort(data, size, sizeof(int), mergesort_int_comparator);
+}
+
+static int
+sort_radix(int *data, size_t size) {
+  return radixsort_int(data, size);
+}
+
+static int
+sort_qsort(int *data, size_t size) {
+  qsort(data, size, sizeof(int), mergesort_int_comparator);
+  return 0;
+}
+
+struct bench_sort_case {
+  const char *name;
+  int (*sort)(int *data, size_t size);
+  /** Vector instructions allowed to mergesort(). */
+  enum mergesort_simd simd;
+};
+
+static const struct bench_sort_case bench_sort_cases[] = {
+  {"mergesort baseline (malloc per level)", sort_baseline,
+   MERGESORT_SIMD_NONE},
+  {"mergesort, unknown comparator", sort_generic, MERGESORT_SIMD_NONE},
+  {"mergesort, mergesort_int_comparator, scalar", sort_specialized,
+   MERGESORT_SIMD_NONE},
+  {"mergesort, mergesort_int_comparator, SSE4.1", sort_specialized,
+   MERGESORT_SIMD_SSE41},
+  {"mergesort, mergesort_int_comparator, AVX2", sort_specialized,
+   MERGESORT_SIMD_AVX2},
+  {"radixsort_int", sort_radix, MERGESORT_SIMD_NONE},
+  {"qsort", sort_qsort, MERGESORT_SIMD_NONE},
+};
+
+static int
+read_file(const char *filename, struct int_parser *parser) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("Error opening the file");
+    return -1;
+  }
+  char buf[64 * 1024];
+  int rc = int_parser_create(parser, 0);
+  ssize_t len;
+  while (rc == 0 && (len = read(fd, buf, sizeof(buf))) > 0)
+    rc = int_parser_feed(parser, buf, len);
+  close(fd);
+  if (rc == 0)
+    rc = int_parser_finish(parser);
+  if (rc != 0)
+    printf("Error parsing %s\n", filename);
+  return rc;
+}
+
+int main(int argc, char **argv) {
+  size_t prefix = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt != 'n') {
+      printf("Usage: %s [-n count] file...\n", argv[0]);
+      return 1;
+    }
+    prefix = strtoull(optarg, NULL, 10);
+  }
+  if (optind == argc) {
+    printf("Usage: %s [-n count] file...\n", argv[0]);
+    return 1;
+  }
+  int file_count = argc - optind;
+  struct int_parser *files = calloc(file_count, sizeof(*files));
+  size_t max_size = 0;
+  size_t total_size = 0;
+  for (int i = 0; i < file_count; ++i) {
+    if (read_file(argv[optind + i], &files[i]) != 0)
+      return 1;
+    if (prefix > 0 && files[i].size > prefix)
+      files[i].size = prefix;
+    if (files[i].size > max_size)
+      max_size = files[i].size;
+    total_size += files[i].size;
+  }
+  int *data = malloc(max_size * sizeof(int) + 1);
+  /* The sorts check the quanta, so the scheduler must be there. */
+  coro_sched_init();
+
+  printf("%d files, %zu numbers\n", file_count, total_size);
+  size_t case_count = sizeof(bench_sort_cases) / sizeof(bench_sort_cases[0]);
+  for (size_t c = 0; c < case_count; ++c) {
+    if (mergesort_set_simd(bench_sort_cases[c].simd) !=
+        bench_sort_cases[c].simd) {
+      printf("%s\n    not supported\n", bench_sort_cases[c].name);
+      continue;
+    }
+    double samples[BENCH_RUN_COUNT];
+    for (int run = 0; run < BENCH_RUN_COUNT; ++run) {
+      long long duration = 0;
+      for (int i = 0; i < file_count; ++i) {
+        memcpy(data, files[i].data, files[i].size * sizeof(int));
+        long long start = bench_now_ns();
+        if (bench_sort_cases[c].sort(data, files[i].size) != 0) {
+          printf("Sort failed\n");
+          return 1;
+        }
+        duration += bench_now_ns() - start;
+        for (size_t j = 1; j < files[i].size; ++j) {
+          if (data[j - 1] > data[j]) {
+            printf("%s: not sorted\n", bench_sort_cases[c].name);
+            return 1;
+          }
+        }
+      }
+      samples[run] = (double)duration / total_size;
+    }
+    bench_report(bench_sort_cases[c].name, samples, BENCH_RUN_COUNT,
+                 "ns/element");
+  }
+  free(data);
+  for (int i = 0; i < file_count; ++i)
+    int_parser_destroy(&files[i]);
+  free(files);
+  coro_sched_destroy();
+  return 0;
+}
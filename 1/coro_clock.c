@@ -0,0 +1,143 @@
+#include "coro_clock.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+enum coro_clock_type {
+  CORO_CLOCK_MONOTONIC,
+  CORO_CLOCK_TSC,
+  CORO_CLOCK_CNTVCT,
+};
+
+/** Chosen clock source. */
+static enum coro_clock_type coro_clock_type = CORO_CLOCK_MONOTONIC;
+/** Ticks per second. */
+static unsigned long long coro_clock_freq = 1000000000;
+/** Microseconds per tick as a 32.32 fixed point number. */
+static unsigned long long coro_clock_us_mult = (1000000ULL << 32) / 1000000000;
+static bool coro_clock_is_initialized = false;
+
+enum {
+  /** How long to compare the counter with clock_gettime(). */
+  CORO_CLOCK_CALIBRATE_NS = 2000000,
+};
+
+static long long
+coro_clock_monotonic_ns(void) {
+  struct timespec t_time;
+  clock_gettime(CLOCK_MONOTONIC, &t_time);
+  return t_time.tv_sec * 1000000000LL + t_time.tv_nsec;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * TSC can be used as a clock only if it is invariant - ticks with
+ * a constant rate regardless of frequency scaling and C-states.
+ */
+static bool
+coro_clock_tsc_is_invariant(void) {
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 ||
+      eax < 0x80000007)
+    return false;
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx & (1 << 8)) != 0;
+}
+
+/** Measure the TSC frequency against the monotonic clock. */
+static unsigned long long
+coro_clock_tsc_calibrate(void) {
+  unsigned eax, ebx, ecx, edx;
+  /* The exact frequency, when the CPU reports it. */
+  if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) != 0 && eax >= 0x15) {
+    __get_cpuid(0x15, &eax, &ebx, &ecx, &edx);
+    if (eax != 0 && ebx != 0 && ecx != 0)
+      return (unsigned long long)ecx * ebx / eax;
+  }
+  long long ns_start = coro_clock_monotonic_ns();
+  unsigned long long tsc_start = __rdtsc();
+  long long ns_end;
+  do {
+    ns_end = coro_clock_monotonic_ns();
+  } while (ns_end - ns_start < CORO_CLOCK_CALIBRATE_NS);
+  unsigned long long tsc_end = __rdtsc();
+  return (unsigned __int128)(tsc_end - tsc_start) * 1000000000 /
+         (ns_end - ns_start);
+}
+
+#endif
+
+void coro_clock_init(void) {
+  if (coro_clock_is_initialized)
+    return;
+  coro_clock_is_initialized = true;
+#if defined(__x86_64__)
+  if (coro_clock_tsc_is_invariant()) {
+    unsigned long long freq = coro_clock_tsc_calibrate();
+    if (freq != 0) {
+      coro_clock_type = CORO_CLOCK_TSC;
+      coro_clock_freq = freq;
+    }
+  }
+#elif defined(__aarch64__)
+  /* The generic timer is constant-rate and reports its frequency. */
+  unsigned long long freq;
+  __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+  if (freq != 0) {
+    coro_clock_type = CORO_CLOCK_CNTVCT;
+    coro_clock_freq = freq;
+  }
+#endif
+  coro_clock_us_mult = (1000000ULL << 32) / coro_clock_freq;
+}
+
+long long
+coro_clock_now(void) {
+  switch (coro_clock_type) {
+#if defined(__x86_64__)
+    case CORO_CLOCK_TSC:
+      return __rdtsc();
+#elif defined(__aarch64__)
+    case CORO_CLOCK_CNTVCT: {
+      unsigned long long ticks;
+      __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks));
+      return ticks;
+    }
+#endif
+    default:
+      return coro_clock_monotonic_ns();
+  }
+}
+
+long long
+coro_clock_to_us(long long ticks) {
+  if (ticks < 0)
+    return -coro_clock_to_us(-ticks);
+  return ((unsigned __int128)ticks * coro_clock_us_mult) >> 32;
+}
+
+long long
+coro_clock_from_us(long long us) {
+  if (us < 0)
+    return -coro_clock_from_us(-us);
+  return (unsigned __int128)us * coro_clock_freq / 1000000;
+}
+
+const char *
+coro_clock_source(void) {
+  switch (coro_clock_type) {
+    case CORO_CLOCK_TSC:
+      return "tsc";
+    case CORO_CLOCK_CNTVCT:
+      return "cntvct";
+    default:
+      return "monotonic";
+  }
+}
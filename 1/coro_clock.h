@@ -0,0 +1,31 @@
+#pragma once
+
+/**
+ * Cheap monotonic clock for the coroutine time accounting. On
+ * x86-64 with an invariant TSC it is rdtsc, on aarch64 - the
+ * generic timer counter. Otherwise clock_gettime(CLOCK_MONOTONIC)
+ * is used. The time is measured in abstract ticks, which are
+ * converted to microseconds only when reported.
+ */
+
+/**
+ * Detect the clock source and calibrate its frequency. Must be
+ * called before any other function. Repeated calls are no-op.
+ */
+void coro_clock_init(void);
+
+/** Current time in ticks. */
+long long
+coro_clock_now(void);
+
+/** Convert a duration in ticks to microseconds. */
+long long
+coro_clock_to_us(long long ticks);
+
+/** Convert a duration in microseconds to ticks. */
+long long
+coro_clock_from_us(long long us);
+
+/** Name of the clock source: "tsc", "cntvct" or "monotonic". */
+const char *
+coro_clock_source(void);
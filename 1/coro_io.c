@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+#include "coro_io.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libcoro.h"
+
+enum {
+  /** Submission queue size of a ring. */
+  CORO_IO_URING_ENTRIES = 256,
+  /** Helper threads per scheduler thread. */
+  CORO_IO_HELPER_COUNT = 2,
+};
+
+enum coro_io_op {
+  CORO_IO_OP_OPEN,
+  CORO_IO_OP_READ,
+  CORO_IO_OP_WRITE,
+};
+
+/**
+ * One I/O operation. Is built on the caller's stack, and is moved into
+ * the wait slot of the coroutine when submitted - the helper threads
+ * and the poller access it while the coroutine is switched out.
+ */
+struct coro_io_req {
+  enum coro_io_op op;
+  int fd;
+  const char *path;
+  int flags;
+  mode_t mode;
+  void *buf;
+  size_t count;
+  /** Result. >= 0 on success, -errno on error. */
+  long res;
+  /** True, when the result is ready. */
+  bool is_done;
+  /** Coroutine waiting for the result. */
+  struct coro *coro;
+  /** Link in the helper threads' queues. */
+  struct coro_io_req *next;
+};
+
+/** I/O context of one scheduler thread. */
+struct coro_io {
+  /** True for io_uring, false for the helper threads. */
+  bool is_uring;
+  /** Submitted and not yet completed requests. */
+  int inflight;
+
+  /* io_uring backend. */
+  int ring_fd;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  /* Helper threads backend. */
+  pthread_t helpers[CORO_IO_HELPER_COUNT];
+  /** Protects the queues below. */
+  pthread_mutex_t lock;
+  /** Helpers sleep on it until requests appear. */
+  pthread_cond_t cond;
+  /** Requests waiting for a helper. */
+  struct coro_io_req *pending_head;
+  struct coro_io_req *pending_tail;
+  /** Completed requests, not yet seen by the scheduler. */
+  struct coro_io_req *done;
+  /** Signaled by the helpers when something is completed. */
+  int event_fd;
+  bool is_stopped;
+};
+
+static enum coro_io_backend coro_io_backend = CORO_IO_BACKEND_AUTO;
+/** I/O context of the current thread. */
+static __thread struct coro_io *coro_io_this = NULL;
+
+void coro_io_set_backend(enum coro_io_backend backend) {
+  coro_io_backend = backend;
+}
+
+const char *
+coro_io_backend_name(void) {
+  if (coro_io_this == NULL)
+    return NULL;
+  return coro_io_this->is_uring ? "io_uring" : "threads";
+}
+
+/** Do the request right here, blocking the thread. */
+static void
+coro_io_req_execute(struct coro_io_req *req) {
+  long rc;
+  switch (req->op) {
+    case CORO_IO_OP_OPEN:
+      rc = open(req->path, req->flags, req->mode);
+      break;
+    case CORO_IO_OP_READ:
+      rc = read(req->fd, req->buf, req->count);
+      break;
+    case CORO_IO_OP_WRITE:
+      rc = write(req->fd, req->buf, req->count);
+      break;
+    default:
+      abort();
+  }
+  req->res = rc < 0 ? -errno : rc;
+}
+
+/** Mark the request completed and wake up its coroutine. */
+static void
+coro_io_req_complete(struct coro_io *io, struct coro_io_req *req, long res) {
+  req->res = res;
+  req->is_done = true;
+  --io->inflight;
+  coro_wakeup(req->coro);
+}
+
+/* {{{ io_uring backend */
+
+static int
+coro_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+/** Check that the kernel can do all the used operations. */
+static bool
+coro_io_uring_probe(int fd) {
+  size_t size = sizeof(struct io_uring_probe) +
+                IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (probe == NULL)
+    return false;
+  bool ok = false;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+              IORING_OP_LAST) == 0) {
+    const int ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE};
+    ok = true;
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+      if (ops[i] > probe->last_op ||
+          (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+        ok = false;
+    }
+  }
+  free(probe);
+  return ok;
+}
+
+static int
+coro_io_uring_create(struct coro_io *io) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, CORO_IO_URING_ENTRIES, &p);
+  if (fd < 0)
+    return -1;
+  if (!coro_io_uring_probe(fd))
+    goto error_close;
+  io->ring_fd = fd;
+  io->sq_entries = p.sq_entries;
+  io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  io->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool is_single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (is_single_mmap) {
+    if (io->cq_ring_size > io->sq_ring_size)
+      io->sq_ring_size = io->cq_ring_size;
+    io->cq_ring_size = io->sq_ring_size;
+  }
+  io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (io->sq_ring == MAP_FAILED)
+    goto error_close;
+  if (is_single_mmap) {
+    io->cq_ring = io->sq_ring;
+  } else {
+    io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (io->cq_ring == MAP_FAILED)
+      goto error_unmap_sq;
+  }
+  io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (io->sqes == MAP_FAILED)
+    goto error_unmap_cq;
+  char *sq = io->sq_ring;
+  io->sq_head = (unsigned *)(sq + p.sq_off.head);
+  io->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  io->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  io->sq_array = (unsigned *)(sq + p.sq_off.array);
+  char *cq = io->cq_ring;
+  io->cq_head = (unsigned *)(cq + p.cq_off.head);
+  io->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  io->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+error_unmap_cq:
+  if (!is_single_mmap)
+    munmap(io->cq_ring, io->cq_ring_size);
+error_unmap_sq:
+  munmap(io->sq_ring, io->sq_ring_size);
+error_close:
+  close(fd);
+  return -1;
+}
+
+static void
+coro_io_uring_destroy(struct coro_io *io) {
+  munmap(io->sqes, io->sqes_size);
+  if (io->cq_ring != io->sq_ring)
+    munmap(io->cq_ring, io->cq_ring_size);
+  munmap(io->sq_ring, io->sq_ring_size);
+  close(io->ring_fd);
+}
+
+/**
+ * Put the request into the ring and submit it. Fails, if the ring
+ * is full, then the caller should do the request by itself.
+ */
+static int
+coro_io_uring_submit(struct coro_io *io, struct coro_io_req *req) {
+  /* Keeps the completion queue, twice bigger, from overflow. */
+  if ((unsigned)io->inflight >= io->sq_entries)
+    return -1;
+  unsigned tail = *io->sq_tail;
+  unsigned index = tail & *io->sq_mask;
+  struct io_uring_sqe *sqe = &io->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  switch (req->op) {
+    case CORO_IO_OP_OPEN:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)req->path;
+      sqe->len = req->mode;
+      sqe->open_flags = req->flags;
+      break;
+    case CORO_IO_OP_READ:
+    case CORO_IO_OP_WRITE:
+      sqe->opcode = req->op == CORO_IO_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+      sqe->fd = req->fd;
+      sqe->addr = (uintptr_t)req->buf;
+      sqe->len = req->count;
+      /* Use and advance the current file position. */
+      sqe->off = (uint64_t)-1;
+      break;
+    default:
+      abort();
+  }
+  sqe->user_data = (uintptr_t)req;
+  io->sq_array[index] = index;
+  __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  int rc;
+  do {
+    rc = coro_io_uring_enter(io->ring_fd, 1, 0, 0);
+  } while (rc < 0 && errno == EINTR);
+  if (rc < 0) {
+    /* The entry wasn't consumed. Take it back. */
+    __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+coro_io_uring_reap(struct coro_io *io) {
+  unsigned head = *io->cq_head;
+  unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+  int count = 0;
+  for (; head != tail; ++head, ++count) {
+    struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+    coro_io_req_complete(io, (struct coro_io_req *)(uintptr_t)cqe->user_data,
+                         cqe->res);
+  }
+  __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+/* }}} io_uring backend */
+
+/* {{{ Helper threads backend */
+
+static void *
+coro_io_helper_f(void *arg) {
+  struct coro_io *io = arg;
+  pthread_mutex_lock(&io->lock);
+  while (true) {
+    struct coro_io_req *req = io->pending_head;
+    if (req == NULL) {
+      if (io->is_stopped)
+        break;
+      pthread_cond_wait(&io->cond, &io->lock);
+      continue;
+    }
+    io->pending_head = req->next;
+    if (io->pending_head == NULL)
+      io->pending_tail = NULL;
+    pthread_mutex_unlock(&io->lock);
+
+    coro_io_req_execute(req);
+
+    pthread_mutex_lock(&io->lock);
+    req->next = io->done;
+    io->done = req;
+    uint64_t one = 1;
+    if (write(io->event_fd, &one, sizeof(one)) < 0)
+      abort();
+  }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+
+static int
+coro_io_threads_create(struct coro_io *io) {
+  io->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (io->event_fd < 0)
+    return -1;
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->cond, NULL);
+  for (int i = 0; i < CORO_IO_HELPER_COUNT; ++i) {
+    if (pthread_create(&io->helpers[i], NULL, coro_io_helper_f, io) != 0)
+      abort();
+  }
+  return 0;
+}
+
+static void
+coro_io_threads_destroy(struct coro_io *io) {
+  pthread_mutex_lock(&io->lock);
+  io->is_stopped = true;
+  pthread_cond_broadcast(&io->cond);
+  pthread_mutex_unlock(&io->lock);
+  for (int i = 0; i < CORO_IO_HELPER_COUNT; ++i)
+    pthread_join(io->helpers[i], NULL);
+  pthread_cond_destroy(&io->cond);
+  pthread_mutex_destroy(&io->lock);
+  close(io->event_fd);
+}
+
+static void
+coro_io_threads_submit(struct coro_io *io, struct coro_io_req *req) {
+  req->next = NULL;
+  pthread_mutex_lock(&io->lock);
+  if (io->pending_tail == NULL)
+    io->pending_head = req;
+  else
+    io->pending_tail->next = req;
+  io->pending_tail = req;
+  pthread_cond_signal(&io->cond);
+  pthread_mutex_unlock(&io->lock);
+}
+
+static int
+coro_io_threads_reap(struct coro_io *io) {
+  /*
+   * Reset the event before taking the list. Then a completion
+   * which missed the list will raise it again.
+   */
+  uint64_t value;
+  if (read(io->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    abort();
+  pthread_mutex_lock(&io->lock);
+  struct coro_io_req *req = io->done;
+  io->done = NULL;
+  pthread_mutex_unlock(&io->lock);
+  int count = 0;
+  while (req != NULL) {
+    struct coro_io_req *next = req->next;
+    coro_io_req_complete(io, req, req->res);
+    req = next;
+    ++count;
+  }
+  return count;
+}
+
+/* }}} Helper threads backend */
+
+static int
+coro_io_reap(struct coro_io *io) {
+  if (io->is_uring)
+    return coro_io_uring_reap(io);
+  return coro_io_threads_reap(io);
+}
+
+/** Scheduler poller, harvests completions. */
+static int
+coro_io_poll(void *arg, int timeout_ms) {
+  struct coro_io *io = arg;
+  if (io->inflight == 0)
+    return -1;
+  int count = coro_io_reap(io);
+  if (count > 0 || timeout_ms == 0)
+    return count;
+  struct pollfd pfd;
+  pfd.fd = io->is_uring ? io->ring_fd : io->event_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  poll(&pfd, 1, timeout_ms);
+  return coro_io_reap(io);
+}
+
+static void
+coro_io_delete(void *arg) {
+  struct coro_io *io = arg;
+  assert(io->inflight == 0);
+  if (io->is_uring)
+    coro_io_uring_destroy(io);
+  else
+    coro_io_threads_destroy(io);
+  free(io);
+  coro_io_this = NULL;
+}
+
+/** Get or create the I/O context of the current thread. */
+static struct coro_io *
+coro_io_get(void) {
+  struct coro_io *io = coro_io_this;
+  if (io != NULL)
+    return io;
+  io = calloc(1, sizeof(*io));
+  if (io == NULL)
+    return NULL;
+  if (coro_io_backend == CORO_IO_BACKEND_AUTO &&
+      coro_io_uring_create(io) == 0) {
+    io->is_uring = true;
+  } else if (coro_io_threads_create(io) != 0) {
+    free(io);
+    return NULL;
+  }
+  coro_sched_set_poller(coro_io_poll, coro_io_delete, io);
+  coro_io_this = io;
+  return io;
+}
+
+_Static_assert(sizeof(struct coro_io_req) <= CORO_WAIT_SLOT_SIZE,
+               "the request fits the wait slot");
+
+/**
+ * Submit the request and sleep until it is completed. Outside of
+ * coroutines or when can't submit - do it right here.
+ */
+static long
+coro_io_do(struct coro_io_req *req) {
+  struct coro_io *io = coro_is_sched() ? NULL : coro_io_get();
+  if (io == NULL) {
+    coro_io_req_execute(req);
+    return req->res;
+  }
+  struct coro *c = coro_this();
+  req = memcpy(coro_wait_slot(c), req, sizeof(*req));
+  req->coro = c;
+  req->is_done = false;
+  if (io->is_uring) {
+    if (coro_io_uring_submit(io, req) != 0) {
+      coro_io_req_execute(req);
+      return req->res;
+    }
+  } else {
+    coro_io_threads_submit(io, req);
+  }
+  ++io->inflight;
+  while (!req->is_done)
+    coro_suspend();
+  return req->res;
+}
+
+/** Convert a request result into the syscall convention. */
+static long
+coro_io_result(long res) {
+  if (res >= 0)
+    return res;
+  errno = -res;
+  return -1;
+}
+
+int coro_open(const char *path, int flags, mode_t mode) {
+  struct coro_io_req req;
+  memset(&req, 0, sizeof(req));
+  req.op = CORO_IO_OP_OPEN;
+  req.path = path;
+  req.flags = flags | O_CLOEXEC;
+  req.mode = mode;
+  return coro_io_result(coro_io_do(&req));
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t count) {
+  struct coro_io_req req;
+  memset(&req, 0, sizeof(req));
+  req.op = CORO_IO_OP_READ;
+  req.fd = fd;
+  req.buf = buf;
+  req.count = count;
+  return coro_io_result(coro_io_do(&req));
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t count) {
+  struct coro_io_req req;
+  memset(&req, 0, sizeof(req));
+  req.op = CORO_IO_OP_WRITE;
+  req.fd = fd;
+  req.buf = (void *)buf;
+  req.count = count;
+  return coro_io_result(coro_io_do(&req));
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sys/types.h>
+
+/**
+ * File I/O for coroutines. A coroutine submits a request, is
+ * suspended, and is woken up on completion, while the other
+ * coroutines keep working. Requests go to io_uring, or, if the
+ * kernel doesn't support it, to helper threads doing the blocking
+ * calls. Each thread running coroutines has its own ring or
+ * helpers, which are destroyed together with its scheduler.
+ *
+ * The functions behave like open(), read() and write(): on error
+ * -1 is returned and errno is set. Called outside of a coroutine
+ * they just do the blocking call.
+ */
+
+enum coro_io_backend {
+  /** io_uring, if available. Helper threads otherwise. */
+  CORO_IO_BACKEND_AUTO,
+  /** Always use helper threads. */
+  CORO_IO_BACKEND_THREADS,
+};
+
+/**
+ * Choose the backend for the threads which haven't done any I/O
+ * yet. Auto by default.
+ */
+void coro_io_set_backend(enum coro_io_backend backend);
+
+/**
+ * Name of the current thread's backend: "io_uring" or "threads".
+ * NULL, if no I/O was done in the thread yet.
+ */
+const char *
+coro_io_backend_name(void);
+
+int coro_open(const char *path, int flags, mode_t mode);
+
+ssize_t
+coro_read(int fd, void *buf, size_t count);
+
+ssize_t
+coro_write(int fd, const void *buf, size_t count);
@@ -0,0 +1,205 @@
+#include "coro_sync.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcoro.h"
+
+/**
+ * A coroutine parked in a wait queue. Lives in its wait slot, not on
+ * the stack - that one is not addressable in the shared stack mode.
+ */
+struct coro_waiter {
+  struct coro *coro;
+  struct coro_waiter *next;
+  /** Set by the waker under the queue's lock. */
+  bool is_woken;
+};
+
+_Static_assert(sizeof(struct coro_waiter) <= CORO_WAIT_SLOT_SIZE,
+               "the waiter fits the wait slot");
+
+static inline void
+coro_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ volatile("yield");
+#endif
+}
+
+void coro_spin_lock(struct coro_spinlock *lock) {
+  while (__atomic_exchange_n(&lock->is_locked, 1, __ATOMIC_ACQUIRE) != 0) {
+    while (__atomic_load_n(&lock->is_locked, __ATOMIC_RELAXED) != 0)
+      coro_cpu_relax();
+  }
+}
+
+void coro_spin_unlock(struct coro_spinlock *lock) {
+  __atomic_store_n(&lock->is_locked, 0, __ATOMIC_RELEASE);
+}
+
+void coro_wait_queue_wait(struct coro_wait_queue *queue,
+                          struct coro_spinlock *lock) {
+  assert(!coro_is_sched());
+  struct coro *c = coro_this();
+  struct coro_waiter *waiter = coro_wait_slot(c);
+  waiter->coro = c;
+  waiter->next = NULL;
+  waiter->is_woken = false;
+  /* The waker unlinks the waiter, it never outlives the wait. */
+  if (queue->tail == NULL)
+    queue->head = waiter;
+  else
+    queue->tail->next = waiter;
+  queue->tail = waiter;
+  /*
+   * The waker sets the flag and wakes the coroutine up under the
+   * lock. So when the flag is seen, the waker is done with the
+   * waiter and the coroutine, and both can go away. A wakeup coming
+   * before the suspension is not lost, and a spurious one just makes
+   * the flag be checked again.
+   */
+  while (!waiter->is_woken) {
+    coro_spin_unlock(lock);
+    coro_suspend();
+    coro_spin_lock(lock);
+  }
+}
+
+bool coro_wait_queue_wake_one(struct coro_wait_queue *queue) {
+  struct coro_waiter *waiter = queue->head;
+  if (waiter == NULL)
+    return false;
+  queue->head = waiter->next;
+  if (queue->head == NULL)
+    queue->tail = NULL;
+  waiter->is_woken = true;
+  coro_wakeup(waiter->coro);
+  return true;
+}
+
+void coro_wait_queue_wake_all(struct coro_wait_queue *queue) {
+  while (coro_wait_queue_wake_one(queue))
+    ;
+}
+
+void coro_mutex_create(struct coro_mutex *mutex) {
+  struct coro_mutex init = CORO_MUTEX_INITIALIZER;
+  *mutex = init;
+}
+
+void coro_mutex_lock(struct coro_mutex *mutex) {
+  coro_spin_lock(&mutex->lock);
+  while (mutex->is_locked)
+    coro_wait_queue_wait(&mutex->waiters, &mutex->lock);
+  mutex->is_locked = true;
+  coro_spin_unlock(&mutex->lock);
+}
+
+bool coro_mutex_trylock(struct coro_mutex *mutex) {
+  coro_spin_lock(&mutex->lock);
+  bool ok = !mutex->is_locked;
+  mutex->is_locked = true;
+  coro_spin_unlock(&mutex->lock);
+  return ok;
+}
+
+void coro_mutex_unlock(struct coro_mutex *mutex) {
+  coro_spin_lock(&mutex->lock);
+  assert(mutex->is_locked);
+  mutex->is_locked = false;
+  coro_wait_queue_wake_one(&mutex->waiters);
+  coro_spin_unlock(&mutex->lock);
+}
+
+void coro_cond_create(struct coro_cond *cond) {
+  struct coro_cond init = CORO_COND_INITIALIZER;
+  *cond = init;
+}
+
+void coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex) {
+  /*
+   * The cond's lock is taken before the mutex is released, so a
+   * signal sent after the unlock can't miss this waiter.
+   */
+  coro_spin_lock(&cond->lock);
+  coro_mutex_unlock(mutex);
+  coro_wait_queue_wait(&cond->waiters, &cond->lock);
+  coro_spin_unlock(&cond->lock);
+  coro_mutex_lock(mutex);
+}
+
+void coro_cond_signal(struct coro_cond *cond) {
+  coro_spin_lock(&cond->lock);
+  coro_wait_queue_wake_one(&cond->waiters);
+  coro_spin_unlock(&cond->lock);
+}
+
+void coro_cond_broadcast(struct coro_cond *cond) {
+  coro_spin_lock(&cond->lock);
+  coro_wait_queue_wake_all(&cond->waiters);
+  coro_spin_unlock(&cond->lock);
+}
+
+int coro_chan_create(struct coro_chan *chan, size_t capacity,
+                     size_t element_size) {
+  memset(chan, 0, sizeof(*chan));
+  if (capacity == 0)
+    capacity = 1;
+  chan->buf = malloc(capacity * element_size);
+  if (chan->buf == NULL)
+    return -1;
+  chan->capacity = capacity;
+  chan->element_size = element_size;
+  return 0;
+}
+
+void coro_chan_destroy(struct coro_chan *chan) {
+  assert(coro_wait_queue_is_empty(&chan->senders));
+  assert(coro_wait_queue_is_empty(&chan->receivers));
+  free(chan->buf);
+  chan->buf = NULL;
+}
+
+int coro_chan_send(struct coro_chan *chan, const void *element) {
+  coro_spin_lock(&chan->lock);
+  while (!chan->is_closed && chan->size == chan->capacity)
+    coro_wait_queue_wait(&chan->senders, &chan->lock);
+  if (chan->is_closed) {
+    coro_spin_unlock(&chan->lock);
+    return -1;
+  }
+  size_t tail = (chan->head + chan->size) % chan->capacity;
+  memcpy(chan->buf + tail * chan->element_size, element, chan->element_size);
+  ++chan->size;
+  coro_wait_queue_wake_one(&chan->receivers);
+  coro_spin_unlock(&chan->lock);
+  return 0;
+}
+
+int coro_chan_recv(struct coro_chan *chan, void *element) {
+  coro_spin_lock(&chan->lock);
+  while (!chan->is_closed && chan->size == 0)
+    coro_wait_queue_wait(&chan->receivers, &chan->lock);
+  if (chan->size == 0) {
+    coro_spin_unlock(&chan->lock);
+    return -1;
+  }
+  memcpy(element, chan->buf + chan->head * chan->element_size,
+         chan->element_size);
+  chan->head = (chan->head + 1) % chan->capacity;
+  --chan->size;
+  coro_wait_queue_wake_one(&chan->senders);
+  coro_spin_unlock(&chan->lock);
+  return 0;
+}
+
+void coro_chan_close(struct coro_chan *chan) {
+  coro_spin_lock(&chan->lock);
+  chan->is_closed = true;
+  coro_wait_queue_wake_all(&chan->senders);
+  coro_wait_queue_wake_all(&chan->receivers);
+  coro_spin_unlock(&chan->lock);
+}
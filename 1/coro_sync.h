@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Synchronization of coroutines. A waiting coroutine is parked in a
+ * wait queue and suspended - it is not in the ready queue and costs
+ * nothing until woken up, which is O(1). All the objects work in M:N
+ * mode too: their state is protected by spinlocks, which are never
+ * held across a context switch.
+ *
+ * Waiting is allowed only in coroutines, not in the scheduler.
+ */
+
+struct coro_spinlock {
+  int is_locked;
+};
+
+#define CORO_SPINLOCK_INITIALIZER {0}
+
+void coro_spin_lock(struct coro_spinlock *lock);
+
+void coro_spin_unlock(struct coro_spinlock *lock);
+
+struct coro_waiter;
+
+/** Coroutines parked until an event, woken in FIFO order. */
+struct coro_wait_queue {
+  struct coro_waiter *head;
+  struct coro_waiter *tail;
+};
+
+#define CORO_WAIT_QUEUE_INITIALIZER {NULL, NULL}
+
+/**
+ * Park the current coroutine until woken by the queue. The queue is
+ * protected by @a lock, which must be held. It is released while
+ * parked and taken again before the return.
+ */
+void coro_wait_queue_wait(struct coro_wait_queue *queue,
+                          struct coro_spinlock *lock);
+
+/**
+ * Wake the longest waiting coroutine up. The lock protecting the
+ * queue must be held. Returns false, if nobody waits.
+ */
+bool coro_wait_queue_wake_one(struct coro_wait_queue *queue);
+
+/** Wake all the waiting coroutines up. Same as wake_one. */
+void coro_wait_queue_wake_all(struct coro_wait_queue *queue);
+
+static inline bool
+coro_wait_queue_is_empty(const struct coro_wait_queue *queue) {
+  return queue->head == NULL;
+}
+
+struct coro_mutex {
+  struct coro_spinlock lock;
+  bool is_locked;
+  struct coro_wait_queue waiters;
+};
+
+#define CORO_MUTEX_INITIALIZER \
+  {CORO_SPINLOCK_INITIALIZER, false, CORO_WAIT_QUEUE_INITIALIZER}
+
+void coro_mutex_create(struct coro_mutex *mutex);
+
+void coro_mutex_lock(struct coro_mutex *mutex);
+
+/** Returns false, if the mutex is locked by someone. */
+bool coro_mutex_trylock(struct coro_mutex *mutex);
+
+/**
+ * Unlock and wake the next waiter, if any. The mutex is not handed
+ * over - a coroutine locking it meanwhile can take it first.
+ */
+void coro_mutex_unlock(struct coro_mutex *mutex);
+
+struct coro_cond {
+  struct coro_spinlock lock;
+  struct coro_wait_queue waiters;
+};
+
+#define CORO_COND_INITIALIZER \
+  {CORO_SPINLOCK_INITIALIZER, CORO_WAIT_QUEUE_INITIALIZER}
+
+void coro_cond_create(struct coro_cond *cond);
+
+/**
+ * Unlock the mutex, wait for a signal, lock the mutex back. Can wake
+ * up spuriously, the condition has to be checked in a loop.
+ */
+void coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex);
+
+void coro_cond_signal(struct coro_cond *cond);
+
+void coro_cond_broadcast(struct coro_cond *cond);
+
+/**
+ * Bounded FIFO channel of fixed-size elements. A sender waits when
+ * the channel is full, a receiver - when it is empty.
+ */
+struct coro_chan {
+  struct coro_spinlock lock;
+  char *buf;
+  size_t element_size;
+  size_t capacity;
+  /** Index of the oldest element. */
+  size_t head;
+  size_t size;
+  bool is_closed;
+  struct coro_wait_queue senders;
+  struct coro_wait_queue receivers;
+};
+
+/**
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int coro_chan_create(struct coro_chan *chan, size_t capacity,
+                     size_t element_size);
+
+/** Free the buffer. Nobody may wait on the channel. */
+void coro_chan_destroy(struct coro_chan *chan);
+
+/**
+ * Copy an element into the channel, wait for space if it is full.
+ * @retval 0 Sent.
+ * @retval -1 The channel is closed.
+ */
+int coro_chan_send(struct coro_chan *chan, const void *element);
+
+/**
+ * Take the oldest element, wait for one if the channel is empty.
+ * @retval 0 Received.
+ * @retval -1 The channel is closed and empty.
+ */
+int coro_chan_recv(struct coro_chan *chan, void *element);
+
+/**
+ * Close the channel: the senders fail, the receivers get what is
+ * left, and then fail too.
+ */
+void coro_chan_close(struct coro_chan *chan);
@@ -0,0 +1,202 @@
+#include "coro_trace.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coro_clock.h"
+
+/**
+ * A ring slot. The writer takes a slot by incrementing the head,
+ * marks it invalid, fills it, and publishes by setting seq to the
+ * event number + 1. A reader trusts only the slots having the
+ * expected seq before and after the copying, like a seqlock.
+ */
+struct coro_trace_slot {
+  unsigned long long seq;
+  long long ts;
+  unsigned long long coro_id;
+  unsigned state;
+  unsigned thread;
+};
+
+bool coro_trace_is_on = false;
+
+static struct coro_trace_slot *coro_trace_ring = NULL;
+static size_t coro_trace_mask = 0;
+/** Number of events ever recorded. Atomic. */
+static unsigned long long coro_trace_head = 0;
+/** Clock at the trace start, the events are relative to it. */
+static long long coro_trace_start_ts = 0;
+
+int coro_trace_start(size_t capacity) {
+  if (coro_trace_is_on)
+    return -1;
+  size_t size = 1;
+  while (size < capacity)
+    size *= 2;
+  struct coro_trace_slot *ring = calloc(size, sizeof(*ring));
+  if (ring == NULL)
+    return -1;
+  coro_clock_init();
+  free(coro_trace_ring);
+  coro_trace_ring = ring;
+  coro_trace_mask = size - 1;
+  coro_trace_head = 0;
+  coro_trace_start_ts = coro_clock_now();
+  __atomic_store_n(&coro_trace_is_on, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void coro_trace_stop(void) {
+  __atomic_store_n(&coro_trace_is_on, false, __ATOMIC_RELEASE);
+}
+
+void coro_trace_destroy(void) {
+  coro_trace_stop();
+  free(coro_trace_ring);
+  coro_trace_ring = NULL;
+  coro_trace_mask = 0;
+  coro_trace_head = 0;
+}
+
+void coro_trace_record(unsigned long long coro_id, enum coro_trace_state state,
+                       unsigned thread, long long ts) {
+  unsigned long long i = __atomic_fetch_add(&coro_trace_head, 1,
+                                            __ATOMIC_RELAXED);
+  struct coro_trace_slot *slot = &coro_trace_ring[i & coro_trace_mask];
+  __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->ts = ts;
+  slot->coro_id = coro_id;
+  slot->state = state;
+  slot->thread = thread;
+  __atomic_store_n(&slot->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy the event number @a i out of the ring.
+ * @retval 0 Success.
+ * @retval -1 Overwritten or not written completely.
+ */
+static int
+coro_trace_read(unsigned long long i, struct coro_trace_event *event) {
+  struct coro_trace_slot *slot = &coro_trace_ring[i & coro_trace_mask];
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1)
+    return -1;
+  long long ts = slot->ts;
+  event->coro_id = slot->coro_id;
+  event->state = slot->state;
+  event->thread = slot->thread;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1)
+    return -1;
+  ts -= coro_trace_start_ts;
+  /* Converted in 2 parts to keep the precision and not overflow. */
+  long long sec = coro_clock_from_us(1000000);
+  event->ts = (ts / sec) * 1000000000ULL +
+              coro_clock_to_us((ts % sec) * 1000);
+  return 0;
+}
+
+/** Range of the events still in the ring. */
+static void
+coro_trace_range(unsigned long long *begin, unsigned long long *end) {
+  *end = __atomic_load_n(&coro_trace_head, __ATOMIC_ACQUIRE);
+  size_t size = coro_trace_ring == NULL ? 0 : coro_trace_mask + 1;
+  *begin = *end > size ? *end - size : 0;
+}
+
+/** Per-coroutine state while converting the events to slices. */
+struct coro_trace_track {
+  int state;
+  unsigned thread;
+  unsigned long long since;
+};
+
+static const char *const coro_trace_state_names[] = {
+  "ready", "running", "blocked", "finished",
+};
+
+int coro_trace_save_json(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    return -1;
+  unsigned long long begin, end;
+  coro_trace_range(&begin, &end);
+  struct coro_trace_track *tracks = NULL;
+  size_t track_count = 0;
+  int rc = 0;
+  bool is_first = true;
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (unsigned long long i = begin; i < end; ++i) {
+    struct coro_trace_event e;
+    if (coro_trace_read(i, &e) != 0)
+      continue;
+    if (e.coro_id >= track_count) {
+      size_t count = track_count * 2 > e.coro_id + 1 ? track_count * 2 :
+                     e.coro_id + 1;
+      struct coro_trace_track *t = realloc(tracks, count * sizeof(*t));
+      if (t == NULL) {
+        rc = -1;
+        break;
+      }
+      for (size_t j = track_count; j < count; ++j)
+        t[j].state = -1;
+      tracks = t;
+      track_count = count;
+    }
+    /* An event ends the previous state of the coroutine: a slice. */
+    struct coro_trace_track *t = &tracks[e.coro_id];
+    if (t->state >= 0 && t->state != CORO_TRACE_FINISHED) {
+      fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,"
+              "\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,"
+              "\"args\":{\"thread\":%u}}",
+              is_first ? "" : ",", coro_trace_state_names[t->state],
+              e.coro_id, t->since / 1000.0, (e.ts - t->since) / 1000.0,
+              t->thread);
+      is_first = false;
+    }
+    t->state = e.state;
+    t->since = e.ts;
+    t->thread = e.thread;
+  }
+  fprintf(f, "\n]}\n");
+  free(tracks);
+  if (ferror(f))
+    rc = -1;
+  if (fclose(f) != 0)
+    rc = -1;
+  return rc;
+}
+
+int coro_trace_save_binary(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    return -1;
+  unsigned long long begin, end;
+  coro_trace_range(&begin, &end);
+  struct coro_trace_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "CORO_TRC", sizeof(header.magic));
+  header.version = 1;
+  header.event_size = sizeof(struct coro_trace_event);
+  /* The count is patched in the end, torn events are skipped. */
+  fwrite(&header, sizeof(header), 1, f);
+  for (unsigned long long i = begin; i < end; ++i) {
+    struct coro_trace_event e;
+    if (coro_trace_read(i, &e) != 0)
+      continue;
+    fwrite(&e, sizeof(e), 1, f);
+    ++header.event_count;
+  }
+  int rc = 0;
+  if (fseek(f, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, f) != 1 || ferror(f))
+    rc = -1;
+  if (fclose(f) != 0)
+    rc = -1;
+  return rc;
+}
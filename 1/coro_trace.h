@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Scheduler tracing. Each state change of each coroutine is written
+ * into a ring buffer shared by all the threads, lock-free. When the
+ * ring is full the oldest events are overwritten. The trace can be
+ * saved as Chrome trace-event JSON (chrome://tracing, Perfetto),
+ * with a row per coroutine showing when it was running, ready but
+ * waiting for a CPU, or blocked. Or as a compact binary file.
+ */
+
+enum coro_trace_state {
+  /** In a ready queue. */
+  CORO_TRACE_READY,
+  /** On a CPU. */
+  CORO_TRACE_RUNNING,
+  /** Suspended until a wakeup. */
+  CORO_TRACE_BLOCKED,
+  /** Finished, waiting for coro_delete(). */
+  CORO_TRACE_FINISHED,
+  CORO_TRACE_STATE_COUNT,
+};
+
+/** A state change, as stored in the binary trace file. */
+struct coro_trace_event {
+  /** Nanoseconds since the trace start. */
+  unsigned long long ts;
+  /** Coroutine ID, unique in the process, starts from 1. */
+  unsigned long long coro_id;
+  /** enum coro_trace_state. */
+  unsigned state;
+  /** Thread: 0 - main, N - worker N. */
+  unsigned thread;
+};
+
+/**
+ * The binary file is this header followed by event_count events in
+ * the order of recording.
+ */
+struct coro_trace_header {
+  /** "CORO_TRC". */
+  char magic[8];
+  unsigned version;
+  unsigned event_size;
+  unsigned long long event_count;
+};
+
+/** True, when the trace is on. Checked by libcoro on each switch. */
+extern bool coro_trace_is_on;
+
+/**
+ * Start recording into a ring of @a capacity events, rounded up to a
+ * power of 2. Only the coroutines created after that are traced.
+ * @retval 0 Success.
+ * @retval -1 Out of memory, or is on already.
+ */
+int coro_trace_start(size_t capacity);
+
+/** Stop recording. The recorded events are kept for saving. */
+void coro_trace_stop(void);
+
+/**
+ * Save the recorded events as Chrome trace-event JSON.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int coro_trace_save_json(const char *path);
+
+/**
+ * Save the recorded events in the binary format.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int coro_trace_save_binary(const char *path);
+
+/** Free the recorded events. */
+void coro_trace_destroy(void);
+
+/** Record a state change. Used by libcoro. */
+void coro_trace_record(unsigned long long coro_id, enum coro_trace_state state,
+                       unsigned thread, long long ts);
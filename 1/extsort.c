@@ -0,0 +1,484 @@
+#include "extsort.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "coro_io.h"
+#include "coro_sync.h"
+#include "intio.h"
+#include "libcoro.h"
+#include "mergesort.h"
+#include "radixsort.h"
+
+/** Max size of the text chunks the input is read by. */
+enum { EXTSORT_READ_CHUNK = 64 * 1024 };
+/** Min size of a block the runs are read and written by in the merge. */
+enum { EXTSORT_MIN_MERGE_BUF = 4 * 1024 };
+
+int extsort_create(struct extsort *s, size_t budget, int file_count,
+                   int quant_time) {
+  memset(s, 0, sizeof(*s));
+  /* Half of the budget is for the run generation, half for merge. */
+  size_t file_budget = budget / 2 / (file_count > 0 ? file_count : 1);
+  s->merge_budget = budget / 2;
+  /* A 2-way merge needs 2 blocks to read and 1 to write. */
+  if (file_budget < EXTSORT_MIN_FILE_BUDGET ||
+      s->merge_budget < 3 * EXTSORT_MIN_MERGE_BUF) {
+    errno = EINVAL;
+    return -1;
+  }
+  /*
+   * A file takes a text chunk, two run buffers - one is filled while
+   * the other is spilled - and the scratch of the spill's sort, as big
+   * as a run buffer. A chunk of text has up to chunk / 2 numbers, so
+   * the chunk is kept small enough for a few of them to fit a run.
+   */
+  s->read_chunk = file_budget / 16;
+  if (s->read_chunk > EXTSORT_READ_CHUNK)
+    s->read_chunk = EXTSORT_READ_CHUNK;
+  size_t run_budget = file_budget - s->read_chunk;
+  s->use_radix = run_budget >= RADIXSORT_HISTOGRAM_SIZE +
+                 3 * RADIXSORT_MIN_SIZE * sizeof(int);
+  if (s->use_radix)
+    run_budget -= RADIXSORT_HISTOGRAM_SIZE;
+  s->buf_capacity = run_budget / 3 / sizeof(int);
+  s->quant_time = quant_time;
+  s->dir = getenv("TMPDIR");
+  if (s->dir == NULL || *s->dir == 0)
+    s->dir = "/tmp";
+  pthread_mutex_init(&s->lock, NULL);
+  return 0;
+}
+
+void extsort_destroy(struct extsort *s) {
+  for (size_t i = 0; i < s->file_count; ++i)
+    close(s->files[i]);
+  free(s->files);
+  s->files = NULL;
+  s->file_count = 0;
+  free(s->runs);
+  s->runs = NULL;
+  s->run_count = 0;
+  pthread_mutex_destroy(&s->lock);
+}
+
+/**
+ * Create an unlinked temporary file, so it is gone with the fd. It
+ * is closed by extsort_destroy().
+ */
+static int
+extsort_tmpfile(struct extsort *s) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/extsort-XXXXXX", s->dir);
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return -1;
+  unlink(path);
+  int rc = 0;
+  pthread_mutex_lock(&s->lock);
+  if (s->file_count == s->file_capacity) {
+    size_t capacity = s->file_capacity * 2 + 8;
+    int *files = realloc(s->files, capacity * sizeof(*files));
+    if (files == NULL) {
+      rc = -1;
+    } else {
+      s->files = files;
+      s->file_capacity = capacity;
+    }
+  }
+  if (rc == 0)
+    s->files[s->file_count++] = fd;
+  pthread_mutex_unlock(&s->lock);
+  if (rc != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+extsort_add_run(struct extsort *s, const struct extsort_run *run) {
+  int rc = 0;
+  pthread_mutex_lock(&s->lock);
+  if (s->run_count == s->run_capacity) {
+    size_t capacity = s->run_capacity * 2 + 8;
+    struct extsort_run *runs = realloc(s->runs, capacity * sizeof(*runs));
+    if (runs == NULL) {
+      rc = -1;
+    } else {
+      s->runs = runs;
+      s->run_capacity = capacity;
+    }
+  }
+  if (rc == 0)
+    s->runs[s->run_count++] = *run;
+  pthread_mutex_unlock(&s->lock);
+  return rc;
+}
+
+/** A run being sorted and written by a child coroutine. */
+struct extsort_spill {
+  struct extsort *s;
+  int *data;
+  /** Where the run goes. */
+  struct extsort_run run;
+  /** The coroutine filling the runs, waiting for the spill end. */
+  struct coro_wait_queue waiters;
+  /** Protects the result and the waiters. */
+  struct coro_spinlock lock;
+  bool is_busy;
+  int rc;
+};
+
+static int
+extsort_spill_f(void *arg) {
+  struct extsort_spill *sp = arg;
+  int rc;
+  if (sp->s->use_radix && sp->run.count >= RADIXSORT_MIN_SIZE)
+    rc = radixsort_int(sp->data, sp->run.count);
+  else
+    rc = mergesort(sp->data, sp->run.count, sizeof(int),
+                   mergesort_int_comparator);
+  /* The spills of a file go one by one, each at the file's end. */
+  const char *pos = (const char *)sp->data;
+  size_t left = sp->run.count * sizeof(int);
+  while (rc == 0 && left > 0) {
+    ssize_t len = coro_write(sp->run.fd, pos, left);
+    if (len <= 0) {
+      rc = -1;
+      break;
+    }
+    pos += len;
+    left -= len;
+  }
+  if (rc == 0)
+    rc = extsort_add_run(sp->s, &sp->run);
+  if (rc != 0)
+    perror("Error spilling a run");
+  coro_spin_lock(&sp->lock);
+  sp->rc = rc;
+  sp->is_busy = false;
+  coro_wait_queue_wake_all(&sp->waiters);
+  coro_spin_unlock(&sp->lock);
+  return rc;
+}
+
+/** Wait until the spill, if any, is over. */
+static int
+extsort_spill_wait(struct extsort_spill *sp) {
+  coro_spin_lock(&sp->lock);
+  while (sp->is_busy)
+    coro_wait_queue_wait(&sp->waiters, &sp->lock);
+  int rc = sp->rc;
+  coro_spin_unlock(&sp->lock);
+  return rc;
+}
+
+static int
+extsort_spill_start(struct extsort_spill *sp, int fd, off_t offset,
+                    size_t count) {
+  sp->run.fd = fd;
+  sp->run.offset = offset;
+  sp->run.count = count;
+  sp->is_busy = true;
+  if (coro_new(extsort_spill_f, sp, sp->s->quant_time) == NULL) {
+    sp->is_busy = false;
+    return -1;
+  }
+  return 0;
+}
+
+int extsort_add_file(struct extsort *s, const char *filename) {
+  int fd = coro_open(filename, O_RDONLY, 0);
+  if (fd < 0) {
+    perror("Error opening the file");
+    return -1;
+  }
+  /* All the runs of the file go into one temporary file. */
+  int run_fd = extsort_tmpfile(s);
+  if (run_fd < 0) {
+    perror("Error creating a temporary file");
+    close(fd);
+    return -1;
+  }
+  off_t run_offset = 0;
+  /*
+   * Two run buffers: one is filled while the other is spilled. A run
+   * is cut when the next chunk could overflow the buffer.
+   */
+  size_t chunk_max = s->read_chunk / 2 + 1;
+  struct extsort_spill spills[2];
+  char *chunk = malloc(s->read_chunk);
+  int rc = chunk == NULL ? -1 : 0;
+  for (int i = 0; i < 2; ++i) {
+    spills[i].s = s;
+    spills[i].data = malloc(s->buf_capacity * sizeof(int));
+    spills[i].waiters = (struct coro_wait_queue)CORO_WAIT_QUEUE_INITIALIZER;
+    spills[i].lock = (struct coro_spinlock)CORO_SPINLOCK_INITIALIZER;
+    spills[i].is_busy = false;
+    spills[i].rc = 0;
+    if (spills[i].data == NULL)
+      rc = -1;
+  }
+  struct int_parser parser;
+  memset(&parser, 0, sizeof(parser));
+  int cur = 0;
+  parser.data = spills[cur].data;
+  parser.capacity = s->buf_capacity;
+  while (rc == 0) {
+    ssize_t len = coro_read(fd, chunk, s->read_chunk);
+    if (len < 0) {
+      perror("Error reading the file");
+      rc = -1;
+      break;
+    }
+    if (len == 0) {
+      if (int_parser_flush(&parser) != 0) {
+        rc = -1;
+        break;
+      }
+    } else if (int_parser_feed(&parser, chunk, len) != 0) {
+      printf("Not a number in file %s\n", filename);
+      rc = -1;
+      break;
+    }
+    if (parser.size > 0 &&
+        (len == 0 || parser.capacity - parser.size < chunk_max)) {
+      /*
+       * One spill at a time, so there is one sort scratch per file,
+       * and the runs are appended to the file in order.
+       */
+      rc = extsort_spill_wait(&spills[1 - cur]);
+      if (rc == 0)
+        rc = extsort_spill_start(&spills[cur], run_fd, run_offset,
+                                 parser.size);
+      run_offset += parser.size * sizeof(int);
+      cur = 1 - cur;
+      parser.data = spills[cur].data;
+      parser.size = 0;
+    }
+    if (len == 0)
+      break;
+    yield_if_period_end();
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (extsort_spill_wait(&spills[i]) != 0)
+      rc = -1;
+    free(spills[i].data);
+  }
+  free(chunk);
+  close(fd);
+  return rc;
+}
+
+/** A run being read in the merge. */
+struct extsort_reader {
+  int fd;
+  /** Position of the next block in the file. */
+  off_t offset;
+  int *buf;
+  size_t capacity;
+  size_t pos;
+  size_t size;
+  /** Numbers not read from the file yet. */
+  size_t left;
+};
+
+/** Make sure the reader has the next number, unless it is over. */
+static int
+extsort_reader_fill(struct extsort_reader *r) {
+  if (r->pos < r->size || r->left == 0)
+    return 0;
+  size_t count = r->left < r->capacity ? r->left : r->capacity;
+  char *pos = (char *)r->buf;
+  size_t bytes = count * sizeof(int);
+  while (bytes > 0) {
+    ssize_t len = pread(r->fd, pos, bytes, r->offset);
+    if (len < 0)
+      return -1;
+    if (len == 0) {
+      errno = EIO;
+      return -1;
+    }
+    pos += len;
+    bytes -= len;
+    r->offset += len;
+  }
+  r->pos = 0;
+  r->size = count;
+  r->left -= count;
+  return 0;
+}
+
+/**
+ * True, if the reader @a a has a smaller head than @a b. The
+ * loser_tree_before_f of the merge, @a ctx is the readers.
+ */
+static inline bool
+extsort_reader_before(const void *ctx, size_t a, size_t b) {
+  const struct extsort_reader *readers = ctx;
+  const struct extsort_reader *ra = &readers[a];
+  const struct extsort_reader *rb = &readers[b];
+  if (ra->pos == ra->size)
+    return false;
+  if (rb->pos == rb->size)
+    return true;
+  int va = ra->buf[ra->pos];
+  int vb = rb->buf[rb->pos];
+  return va < vb || (va == vb && a < b);
+}
+
+/** Where a merge puts the numbers. */
+typedef int (*extsort_out_f)(void *ctx, const int *data, size_t count);
+
+/** extsort_out_f of the final merge, @a ctx is an int_writer. */
+static int
+extsort_out_writer(void *ctx, const int *data, size_t count) {
+  return int_writer_write(ctx, data, count);
+}
+
+/** The end of a temporary file a merge pass writes to. */
+struct extsort_out_file {
+  int fd;
+  off_t offset;
+};
+
+/** extsort_out_f of a merge pass, @a ctx is an extsort_out_file. */
+static int
+extsort_out_run(void *ctx, const int *data, size_t count) {
+  struct extsort_out_file *f = ctx;
+  const char *pos = (const char *)data;
+  size_t bytes = count * sizeof(int);
+  while (bytes > 0) {
+    ssize_t len = pwrite(f->fd, pos, bytes, f->offset);
+    if (len < 0)
+      return -1;
+    pos += len;
+    bytes -= len;
+    f->offset += len;
+  }
+  return 0;
+}
+
+/**
+ * Merge @a k runs into @a out. Each run is read by blocks of
+ * @a block_size bytes, and the output is passed on by such a block
+ * too, so the merge takes (k + 1) blocks.
+ */
+static int
+extsort_merge_runs(const struct extsort_run *runs, size_t k,
+                   size_t block_size, extsort_out_f out_f, void *out_ctx) {
+  size_t block_count = block_size / sizeof(int);
+  struct extsort_reader *readers = calloc(k, sizeof(*readers));
+  struct loser_tree tree;
+  int *out = malloc(block_count * sizeof(*out));
+  int rc = loser_tree_create(&tree, k);
+  if (readers == NULL || out == NULL)
+    rc = -1;
+  for (size_t i = 0; rc == 0 && i < k; ++i) {
+    readers[i].fd = runs[i].fd;
+    readers[i].offset = runs[i].offset;
+    readers[i].left = runs[i].count;
+    readers[i].capacity = block_count;
+    readers[i].buf = malloc(block_count * sizeof(int));
+    if (readers[i].buf == NULL || extsort_reader_fill(&readers[i]) != 0)
+      rc = -1;
+  }
+  if (rc != 0)
+    goto out;
+  loser_tree_build(&tree, extsort_reader_before, readers);
+  size_t winner = tree.winner;
+  size_t out_size = 0;
+  while (true) {
+    struct extsort_reader *r = &readers[winner];
+    if (r->pos == r->size)
+      break;
+    out[out_size++] = r->buf[r->pos++];
+    if (out_size == block_count) {
+      if (out_f(out_ctx, out, out_size) != 0) {
+        rc = -1;
+        goto out;
+      }
+      out_size = 0;
+    }
+    if (extsort_reader_fill(r) != 0) {
+      rc = -1;
+      goto out;
+    }
+    winner = loser_tree_replay(&tree, extsort_reader_before, readers);
+  }
+  rc = out_f(out_ctx, out, out_size);
+out:
+  for (size_t i = 0; readers != NULL && i < k; ++i)
+    free(readers[i].buf);
+  free(readers);
+  loser_tree_destroy(&tree);
+  free(out);
+  return rc;
+}
+
+/**
+ * Merge the runs by groups of @a fan_in into a new temporary file,
+ * and replace them with the merged ones. The files of the old runs
+ * are closed.
+ */
+static int
+extsort_merge_pass(struct extsort *s, size_t fan_in) {
+  size_t new_count = (s->run_count + fan_in - 1) / fan_in;
+  struct extsort_run *new_runs = malloc(new_count * sizeof(*new_runs));
+  size_t old_file_count = s->file_count;
+  int fd = extsort_tmpfile(s);
+  if (new_runs == NULL || fd < 0) {
+    free(new_runs);
+    return -1;
+  }
+  struct extsort_out_file out = {fd, 0};
+  size_t block_size = s->merge_budget / (fan_in + 1);
+  for (size_t i = 0; i < new_count; ++i) {
+    const struct extsort_run *group = &s->runs[i * fan_in];
+    size_t k = s->run_count - i * fan_in;
+    if (k > fan_in)
+      k = fan_in;
+    new_runs[i].fd = fd;
+    new_runs[i].offset = out.offset;
+    new_runs[i].count = 0;
+    for (size_t j = 0; j < k; ++j)
+      new_runs[i].count += group[j].count;
+    if (extsort_merge_runs(group, k, block_size, extsort_out_run,
+                           &out) != 0) {
+      free(new_runs);
+      return -1;
+    }
+  }
+  /* The old runs are all merged, their files can go. */
+  for (size_t i = 0; i < old_file_count; ++i)
+    close(s->files[i]);
+  memmove(s->files, s->files + old_file_count,
+          (s->file_count - old_file_count) * sizeof(*s->files));
+  s->file_count -= old_file_count;
+  free(s->runs);
+  s->runs = new_runs;
+  s->run_count = new_count;
+  s->run_capacity = new_count;
+  return 0;
+}
+
+int extsort_merge(struct extsort *s, struct int_writer *writer) {
+  if (s->run_count == 0)
+    return 0;
+  /* Each run takes a block, and one more block is for the output. */
+  size_t fan_in = s->merge_budget / EXTSORT_MIN_MERGE_BUF - 1;
+  while (s->run_count > fan_in) {
+    if (extsort_merge_pass(s, fan_in) != 0)
+      return -1;
+  }
+  size_t block_size = s->merge_budget / (s->run_count + 1);
+  return extsort_merge_runs(s->runs, s->run_count, block_size,
+                            extsort_out_writer, writer);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct int_writer;
+
+/**
+ * External sort: the input files are cut into sorted runs which fit
+ * into a memory budget, the runs are spilled to temporary files as
+ * raw ints, then all of them are merged by blocks. When the merge
+ * budget can't hold a block per run, the runs are merged in several
+ * passes.
+ */
+
+/** A sorted run in an unlinked temporary file. */
+struct extsort_run {
+  int fd;
+  /** Position of the run in the file, in bytes. */
+  off_t offset;
+  size_t count;
+};
+
+struct extsort {
+  /** Size of the text chunks each file is read by. */
+  size_t read_chunk;
+  /** Numbers in a run buffer, two per file. */
+  size_t buf_capacity;
+  /** True, if the runs are big enough for radix sort's histograms. */
+  bool use_radix;
+  /** Memory for the merge buffers, in bytes. */
+  size_t merge_budget;
+  /** Quantum of the spill coroutines. */
+  int quant_time;
+  /** Directory for the runs. */
+  const char *dir;
+  /** Runs of all the files. Appended from several threads. */
+  struct extsort_run *runs;
+  size_t run_count;
+  size_t run_capacity;
+  /** Temporary files of the runs: of the input files, of the passes. */
+  int *files;
+  size_t file_count;
+  size_t file_capacity;
+  pthread_mutex_t lock;
+};
+
+/** Min memory budget per input file, in bytes. */
+enum { EXTSORT_MIN_FILE_BUDGET = 16 * 1024 };
+
+/**
+ * Prepare for sorting @a file_count files with @a budget bytes of
+ * memory in total. Half of it is for the run generation, half for
+ * the merge. The buffer of the result writer is not counted. The
+ * runs go to $TMPDIR, or /tmp.
+ * @retval 0 Success.
+ * @retval -1 The budget is too small, errno is EINVAL.
+ */
+int extsort_create(struct extsort *s, size_t budget, int file_count,
+                   int quant_time);
+
+/**
+ * Read the file and spill it as sorted runs. Must be called from a
+ * coroutine: the runs are sorted and written by child coroutines,
+ * while this one keeps reading and parsing the next run.
+ * @retval 0 Success.
+ * @retval -1 Error, reported to stdout.
+ */
+int extsort_add_file(struct extsort *s, const char *filename);
+
+/**
+ * Merge all the runs into the writer, reading them by blocks.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int extsort_merge(struct extsort *s, struct int_writer *writer);
+
+/** Close the runs and free the memory. */
+void extsort_destroy(struct extsort *s);
@@ -0,0 +1,245 @@
+#include "intio.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static inline bool
+int_is_space(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool
+int_is_digit(char c) {
+  return (unsigned char)(c - '0') < 10;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+/** Load 8 bytes, the first one goes to the lowest byte. */
+static inline uint64_t
+int_load8(const char *pos) {
+  uint64_t val;
+  memcpy(&val, pos, sizeof(val));
+  return val;
+}
+
+/** Check that all 8 bytes of a word are ASCII digits. */
+static inline bool
+int_is_eight_digits(uint64_t val) {
+  return ((val & 0xF0F0F0F0F0F0F0F0ULL) |
+          (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+         0x3333333333333333ULL;
+}
+
+/**
+ * Convert 8 ASCII digits into a number at once: pairs of digits
+ * are combined into 2-digit numbers, then 4, then 8.
+ */
+static inline uint32_t
+int_parse_eight_digits(uint64_t val) {
+  val = (val & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+  val = (val & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+  return (uint32_t)((val & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32);
+}
+
+#endif
+
+/** Append a number, the output is normally pre-sized. */
+static inline int
+int_parser_push(struct int_parser *p, unsigned long long value,
+                bool is_negative) {
+  if (p->size == p->capacity) {
+    size_t capacity = p->capacity * 2 + 16;
+    int *data = realloc(p->data, capacity * sizeof(*data));
+    if (data == NULL)
+      return -1;
+    p->data = data;
+    p->capacity = capacity;
+  }
+  p->data[p->size++] = (int)(is_negative ? 0 - value : value);
+  return 0;
+}
+
+int int_parser_create(struct int_parser *p, size_t text_size) {
+  memset(p, 0, sizeof(*p));
+  /* Each number takes at least 2 bytes: a digit and a separator. */
+  p->capacity = text_size / 2 + 1;
+  p->data = malloc(p->capacity * sizeof(*p->data));
+  return p->data == NULL ? -1 : 0;
+}
+
+int int_parser_feed(struct int_parser *p, const char *buf, size_t size) {
+  const char *pos = buf;
+  const char *end = buf + size;
+  unsigned long long value = p->value;
+  int digit_count = p->digit_count;
+  bool is_negative = p->is_negative;
+  if (p->in_number)
+    goto parse_digits;
+  while (true) {
+    while (pos < end && int_is_space(*pos))
+      ++pos;
+    if (pos == end)
+      break;
+    value = 0;
+    digit_count = 0;
+    is_negative = false;
+    if (*pos == '-' || *pos == '+') {
+      is_negative = *pos == '-';
+      ++pos;
+    }
+  parse_digits:
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end - pos >= 8) {
+      uint64_t word = int_load8(pos);
+      if (!int_is_eight_digits(word))
+        break;
+      value = value * 100000000 + int_parse_eight_digits(word);
+      digit_count += 8;
+      pos += 8;
+    }
+#endif
+    while (pos < end && int_is_digit(*pos)) {
+      value = value * 10 + (*pos - '0');
+      ++digit_count;
+      ++pos;
+    }
+    if (pos == end) {
+      /* The number can continue in the next chunk. */
+      p->in_number = true;
+      p->value = value;
+      p->digit_count = digit_count;
+      p->is_negative = is_negative;
+      return 0;
+    }
+    if (digit_count == 0 || !int_is_space(*pos))
+      return -1;
+    if (int_parser_push(p, value, is_negative) != 0)
+      return -1;
+  }
+  p->in_number = false;
+  return 0;
+}
+
+int int_parser_flush(struct int_parser *p) {
+  if (!p->in_number)
+    return 0;
+  p->in_number = false;
+  if (p->digit_count == 0)
+    return -1;
+  return int_parser_push(p, p->value, p->is_negative);
+}
+
+int int_parser_finish(struct int_parser *p) {
+  if (int_parser_flush(p) != 0)
+    return -1;
+  if (p->size < p->capacity) {
+    int *data = realloc(p->data, (p->size + 1) * sizeof(*data));
+    if (data != NULL) {
+      p->data = data;
+      p->capacity = p->size + 1;
+    }
+  }
+  return 0;
+}
+
+void int_parser_destroy(struct int_parser *p) {
+  free(p->data);
+  p->data = NULL;
+  p->size = 0;
+  p->capacity = 0;
+}
+
+/** Size of the writer buffer. */
+enum { INT_WRITER_BUF_SIZE = 1024 * 1024 };
+/** Max length of a formatted number with the separator. */
+enum { INT_TEXT_MAX = 12 };
+
+static const char int_digit_pairs[201] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/**
+ * Decimal digit count without branches: the top bit index picks
+ * a constant, whose addition carries into the upper half exactly
+ * when the value crosses the next power of 10.
+ */
+static inline int
+int_digit_count(uint32_t v) {
+  static const uint64_t table[32] = {
+    4294967296, 8589934582, 8589934582, 8589934582, 12884901788,
+    12884901788, 12884901788, 17179868184, 17179868184, 17179868184,
+    21474826480, 21474826480, 21474826480, 21474826480, 25769703776,
+    25769703776, 25769703776, 30063771072, 30063771072, 30063771072,
+    34349738368, 34349738368, 34349738368, 34349738368, 38554705664,
+    38554705664, 38554705664, 41949672960, 41949672960, 41949672960,
+    42949672960, 42949672960,
+  };
+  return (int)((v + table[31 - __builtin_clz(v | 1)]) >> 32);
+}
+
+/** Format a number followed by a space, return the text length. */
+static inline size_t
+int_format(char *out, int value) {
+  char *pos = out;
+  uint32_t v = (uint32_t)value;
+  if (value < 0) {
+    *pos++ = '-';
+    v = 0 - v;
+  }
+  int len = int_digit_count(v);
+  char *end = pos + len;
+  *end = ' ';
+  while (v >= 100) {
+    uint32_t pair = v % 100;
+    v /= 100;
+    end -= 2;
+    memcpy(end, &int_digit_pairs[pair * 2], 2);
+  }
+  if (v >= 10)
+    memcpy(pos, &int_digit_pairs[v * 2], 2);
+  else
+    *pos = '0' + v;
+  return pos + len + 1 - out;
+}
+
+int int_writer_create(struct int_writer *w, int fd) {
+  w->fd = fd;
+  w->size = 0;
+  w->byte_count = 0;
+  w->capacity = INT_WRITER_BUF_SIZE;
+  w->buf = malloc(w->capacity);
+  return w->buf == NULL ? -1 : 0;
+}
+
+int int_writer_write(struct int_writer *w, const int *data, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (w->capacity - w->size < INT_TEXT_MAX && int_writer_flush(w) != 0)
+      return -1;
+    w->size += int_format(w->buf + w->size, data[i]);
+  }
+  return 0;
+}
+
+int int_writer_flush(struct int_writer *w) {
+  size_t done = 0;
+  while (done < w->size) {
+    ssize_t rc = write(w->fd, w->buf + done, w->size - done);
+    if (rc < 0)
+      return -1;
+    done += rc;
+  }
+  w->byte_count += done;
+  w->size = 0;
+  return 0;
+}
+
+void int_writer_destroy(struct int_writer *w) {
+  free(w->buf);
+  w->buf = NULL;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Streaming parser of whitespace separated decimal integers. The
+ * text can be fed in chunks of any size, a number split between
+ * two chunks is carried over.
+ */
+struct int_parser {
+  /** Parsed numbers. */
+  int *data;
+  size_t size;
+  size_t capacity;
+  /** Absolute value of the number cut by the chunk end. */
+  unsigned long long value;
+  /** Digits of the cut number seen so far. */
+  int digit_count;
+  /** True, if a number was cut by the chunk end. */
+  bool in_number;
+  /** True, if the cut number is negative. */
+  bool is_negative;
+};
+
+/**
+ * Prepare the parser. @a text_size is the expected total text
+ * size, if known, or 0. The output is sized for the max number
+ * count fitting into such a text, so it is never reallocated.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int int_parser_create(struct int_parser *p, size_t text_size);
+
+/**
+ * Parse the next chunk of the text.
+ * @retval 0 Success.
+ * @retval -1 Not a number met, or out of memory.
+ */
+int int_parser_feed(struct int_parser *p, const char *buf, size_t size);
+
+/**
+ * Finish the number cut by the end of the fed text, if any. The
+ * next feed starts a new number.
+ * @retval 0 Success.
+ * @retval -1 The text ends with a sign without digits.
+ */
+int int_parser_flush(struct int_parser *p);
+
+/**
+ * End of the text - finish the last number and trim the output.
+ * Then the numbers are owned by the caller, data and size.
+ * @retval 0 Success.
+ * @retval -1 The text ends with a sign without digits.
+ */
+int int_parser_finish(struct int_parser *p);
+
+/** Free the parser's memory, when the numbers are not needed. */
+void int_parser_destroy(struct int_parser *p);
+
+/**
+ * Buffered writer of integers as text, each followed by a space.
+ * The numbers are formatted into a big buffer which is flushed
+ * with write(), avoiding per-number stdio calls.
+ */
+struct int_writer {
+  int fd;
+  char *buf;
+  size_t size;
+  size_t capacity;
+  /** Total bytes written to the file. */
+  size_t byte_count;
+};
+
+/**
+ * Prepare the writer for an already opened file.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int int_writer_create(struct int_writer *w, int fd);
+
+/**
+ * Format and write the numbers. The text can stay in the buffer
+ * until the next flush.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int int_writer_write(struct int_writer *w, const int *data, size_t count);
+
+/**
+ * Write out the buffered text.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int int_writer_flush(struct int_writer *w);
+
+/** Free the buffer. The file is not flushed nor closed. */
+void int_writer_destroy(struct int_writer *w);
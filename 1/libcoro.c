@@ -1,37 +1,255 @@
+#define _GNU_SOURCE
 #include "libcoro.h"
 
+#include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "coro_clock.h"
+#include "coro_trace.h"
 #include "time.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1); })
 
+/*
+ * Context switch backend. By default a hand-written switch is used
+ * on x86-64 and aarch64: it saves only callee-saved registers and
+ * the stack pointer, and a new stack is prepared directly, without
+ * signals. Define CORO_SWITCH_SIGJMP to fall back to the portable
+ * sigsetjmp/siglongjmp + sigaltstack implementation.
+ */
+#if !defined(CORO_SWITCH_SIGJMP) && !defined(__x86_64__) && \
+    !defined(__aarch64__)
+#define CORO_SWITCH_SIGJMP
+#endif
+
+#ifdef CORO_SWITCH_SIGJMP
+
+/** Saved coroutine context. */
+struct coro_ctx {
+  sigjmp_buf buf;
+};
+
+#else
+
+/**
+ * Saved coroutine context. All the callee-saved registers are
+ * pushed onto the coroutine's own stack, so only the stack
+ * pointer needs to be remembered.
+ */
+struct coro_ctx {
+  void *sp;
+};
+
+/**
+ * Save the callee-saved registers of the current context into
+ * @a from and restore the ones from @a to. Defined in assembly
+ * below.
+ */
+void coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to);
+
+/**
+ * The first function executed on a new stack. Takes the coroutine
+ * from a callee-saved register and passes it to coro_body().
+ */
+void coro_ctx_entry(void);
+
+#if defined(__x86_64__)
+
+/*
+ * Frame layout on a suspended stack, from the stack pointer up:
+ * r15, r14, r13, r12, rbx, rbp, return address.
+ */
+__asm__(
+    "  .text\n"
+    "  .globl coro_ctx_switch\n"
+    "  .hidden coro_ctx_switch\n"
+    "  .type coro_ctx_switch, @function\n"
+    "coro_ctx_switch:\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq (%rsi), %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    "  .size coro_ctx_switch, .-coro_ctx_switch\n"
+    "\n"
+    "  .globl coro_ctx_entry\n"
+    "  .hidden coro_ctx_entry\n"
+    "  .type coro_ctx_entry, @function\n"
+    "coro_ctx_entry:\n"
+    "  movq %r12, %rdi\n"
+    "  callq *%r13\n"
+    "  ud2\n"
+    "  .size coro_ctx_entry, .-coro_ctx_entry\n");
+
+enum {
+  /** Index of r12 - the coroutine argument for the entry. */
+  CORO_CTX_REG_ARG = 3,
+  /** Index of r13 - the function called by the entry. */
+  CORO_CTX_REG_FUNC = 2,
+  /** Index of the return address. */
+  CORO_CTX_REG_RET = 6,
+  /**
+   * Slots of the initial frame: the registers, the return address
+   * and padding, so as the entry gets a 16-byte aligned rsp and
+   * calls coro_body() like any other function.
+   */
+  CORO_CTX_FRAME_SLOTS = 9,
+};
+
+#else /* __aarch64__ */
+
+/*
+ * Frame layout on a suspended stack, from the stack pointer up:
+ * x19-x28, x29 (fp), x30 (lr), d8-d15. The frame size keeps sp
+ * 16-byte aligned.
+ */
+__asm__(
+    "  .text\n"
+    "  .globl coro_ctx_switch\n"
+    "  .hidden coro_ctx_switch\n"
+    "  .type coro_ctx_switch, %function\n"
+    "coro_ctx_switch:\n"
+    "  sub sp, sp, #160\n"
+    "  stp x19, x20, [sp, #0]\n"
+    "  stp x21, x22, [sp, #16]\n"
+    "  stp x23, x24, [sp, #32]\n"
+    "  stp x25, x26, [sp, #48]\n"
+    "  stp x27, x28, [sp, #64]\n"
+    "  stp x29, x30, [sp, #80]\n"
+    "  stp d8, d9, [sp, #96]\n"
+    "  stp d10, d11, [sp, #112]\n"
+    "  stp d12, d13, [sp, #128]\n"
+    "  stp d14, d15, [sp, #144]\n"
+    "  mov x2, sp\n"
+    "  str x2, [x0]\n"
+    "  ldr x2, [x1]\n"
+    "  mov sp, x2\n"
+    "  ldp x19, x20, [sp, #0]\n"
+    "  ldp x21, x22, [sp, #16]\n"
+    "  ldp x23, x24, [sp, #32]\n"
+    "  ldp x25, x26, [sp, #48]\n"
+    "  ldp x27, x28, [sp, #64]\n"
+    "  ldp x29, x30, [sp, #80]\n"
+    "  ldp d8, d9, [sp, #96]\n"
+    "  ldp d10, d11, [sp, #112]\n"
+    "  ldp d12, d13, [sp, #128]\n"
+    "  ldp d14, d15, [sp, #144]\n"
+    "  add sp, sp, #160\n"
+    "  ret\n"
+    "  .size coro_ctx_switch, .-coro_ctx_switch\n"
+    "\n"
+    "  .globl coro_ctx_entry\n"
+    "  .hidden coro_ctx_entry\n"
+    "  .type coro_ctx_entry, %function\n"
+    "coro_ctx_entry:\n"
+    "  mov x0, x19\n"
+    "  blr x20\n"
+    "  brk #0\n"
+    "  .size coro_ctx_entry, .-coro_ctx_entry\n");
+
+enum {
+  /** Index of x19 - the coroutine argument for the entry. */
+  CORO_CTX_REG_ARG = 0,
+  /** Index of x20 - the function called by the entry. */
+  CORO_CTX_REG_FUNC = 1,
+  /** Index of x30 - the link register, used by ret. */
+  CORO_CTX_REG_RET = 11,
+  /** Slots of the initial frame. Restored sp is the stack top. */
+  CORO_CTX_FRAME_SLOTS = 20,
+};
+
+#endif /* __aarch64__ */
+#endif /* CORO_SWITCH_SIGJMP */
+
+/**
+ * Suspension state of a coroutine. A wakeup can come before the
+ * coroutine has finished suspending, or even before it started,
+ * so it is remembered and consumed by the next coro_suspend().
+ */
+enum coro_wake_state {
+  /** Running or in a ready queue. */
+  CORO_WAKE_RUNNABLE = 0,
+  /** Woken up, but was not suspended yet. */
+  CORO_WAKE_PENDING,
+  /** Switching away, the context is not saved yet. */
+  CORO_WAKE_SUSPENDING,
+  /** Suspended, not in any queue. */
+  CORO_WAKE_SUSPENDED,
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
   /** A value, returned by func. */
   int ret;
-  /** Stack, used by the coroutine. */
+  /**
+   * Stack mapping, used by the coroutine. It starts with a guard
+   * page, and the coroutine object itself lives on its top.
+   */
   void *stack;
+  /** Size of the whole stack mapping, including the guard. */
+  size_t stack_size;
+  /**
+   * In the shared stack mode the coroutine has no stack mapping.
+   * Instead its stack is saved here, while it is off the shared
+   * stack. The size is from ctx.sp to the shared stack top.
+   */
+  char *saved;
+  size_t saved_capacity;
   /** An argument for the function func. */
   void *func_arg;
   /** A function to call as a coroutine. */
   coro_f func;
   /** Last remembered coroutine context. */
-  sigjmp_buf ctx;
+  struct coro_ctx ctx;
   /** True, if the coroutine has finished. */
   bool is_finished;
+  /** Suspension state, enum coro_wake_state. Atomic. */
+  int wake_state;
   long long switch_count;
-  /** Links in the coroutine list, used by scheduler. */
+  /**
+   * Links in a scheduler queue - ready or finished. A running
+   * coroutine is not linked anywhere.
+   */
   struct coro *next, *prev;
+  /** Unique ID, for the trace. */
+  unsigned long long id;
+  /**
+   * The state for the trace, enum coro_trace_state, or -1 if not
+   * traced. Changed by the coroutine's own thread, or by the one
+   * waking it up, never concurrently.
+   */
+  int trace_state;
+  /** Start of the current state, in ticks. */
+  long long trace_since;
+  /** Time spent in each state while traced, in ticks. */
+  long long trace_time[CORO_TRACE_STATE_COUNT];
+  /** See coro_wait_slot(). */
+  _Alignas(max_align_t) char wait_slot[CORO_WAIT_SLOT_SIZE];
 
   // ADDED BY STUDENT
   //
+  /* All the times are in coro_clock ticks. */
   long long left_timeperiod;
   long long full_timeperiod;
   long long last_checked_at;
@@ -40,40 +258,116 @@ struct coro {
   // ADDED BY STUDENT
 };
 
-void yield_if_period_end() {
-  struct timespec t_time;
-  clock_gettime(CLOCK_MONOTONIC, &t_time);
-
-  struct coro *this = coro_this();
-
-  long long current_ts = (t_time.tv_sec * 1000000 + t_time.tv_nsec / 1000);
-
-  long long coro_worked = current_ts - this->last_checked_at;
-  this->last_checked_at = current_ts;
-
-  this->total_time_working += coro_worked;
-  this->left_timeperiod = this->left_timeperiod - coro_worked;
-  if (this->left_timeperiod < 0) {
-    this->left_timeperiod = this->full_timeperiod;
-    coro_yield();
-    return;
-  }
-}
+/** Intrusive FIFO of coroutines, linked via next/prev. */
+struct coro_queue {
+  struct coro *head;
+  struct coro *tail;
+};
 
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * Scheduler of one thread. In the normal mode there is only one -
+ * in the main thread. In M:N mode each worker thread has its own,
+ * and the main thread only waits for finished coroutines.
  */
-static struct coro coro_sched;
+struct coro_worker {
+  /**
+   * Scheduler is a main coroutine - it runs the ready ones and
+   * catches dead ones.
+   */
+  struct coro sched;
+  /** Coroutines ready to run, in the order of execution. */
+  struct coro_queue ready;
+  /**
+   * A coroutine which has just switched away and has to be put
+   * back into the ready queue. It is done by whoever gets the
+   * control next, when the coroutine's context is saved already.
+   * Otherwise another worker could steal and resume it too early.
+   */
+  struct coro *to_ready;
+  /** Same as to_ready, but for a finished coroutine. */
+  struct coro *to_finished;
+  /** Same as to_ready, but for a suspended coroutine. */
+  struct coro *to_suspended;
+  /** Source of external wakeups, see coro_sched_set_poller(). */
+  coro_poll_f poll;
+  /** Destructor of the poller, called when the thread stops. */
+  void (*poll_destroy)(void *arg);
+  void *poll_arg;
+  /** Protects the ready queue from thieves in M:N mode. */
+  pthread_mutex_t lock;
+  /** Worker thread. Not used by the main scheduler. */
+  pthread_t thread;
+};
+
+/** Scheduler of the main thread. */
+static struct coro_worker coro_main;
+/** Scheduler of the current thread. */
+static __thread struct coro_worker *coro_worker_ptr = NULL;
+/** Which coroutine works at this moment in this thread. */
+static __thread struct coro *coro_this_ptr = NULL;
 /**
  * True, if in that moment the scheduler is waiting for a
  * coroutine finish.
  */
 static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+/** Finished coroutines, not yet returned by coro_sched_wait(). */
+static struct coro_queue coro_finished = {NULL, NULL};
+
+/** Created and not yet finished coroutines. */
+static int coro_live_count = 0;
+/** Last given coroutine ID. Atomic. */
+static unsigned long long coro_last_id = 0;
+
+/*
+ * M:N mode state. The finished queue and the live counter are
+ * protected by coro_mt_lock then.
+ */
+/** Worker threads. NULL and 0 when M:N mode is off. */
+static struct coro_worker *coro_workers = NULL;
+static int coro_worker_count = 0;
+static pthread_mutex_t coro_mt_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Idle workers sleep on it until new ready coroutines appear. */
+static pthread_cond_t coro_mt_work_cond = PTHREAD_COND_INITIALIZER;
+/** The main thread sleeps on it in coro_sched_wait(). */
+static pthread_cond_t coro_mt_finished_cond = PTHREAD_COND_INITIALIZER;
+/** Coroutines in all the ready queues. Atomic. */
+static int coro_mt_ready_count = 0;
+/** Workers sleeping on coro_mt_work_cond. Atomic. */
+static int coro_mt_idle_count = 0;
+/** Round-robin counter to spread new coroutines. Atomic. */
+static unsigned coro_mt_next_worker = 0;
+/** True, when the workers should exit. */
+static bool coro_mt_is_stopped = false;
+
+/*
+ * Preemption. A per-thread timer raises SIGALRM each tick, and the
+ * handler counts down the quantum of the current coroutine. When
+ * it is over, a flag is set, and the next yield_if_period_end()
+ * yields. So the check is just a load of a thread-local variable.
+ */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+enum coro_preempt_state {
+  /** Preemption is off, the quantum is checked by the clock. */
+  CORO_PREEMPT_OFF = 0,
+  /** The current quantum is not over yet. */
+  CORO_PREEMPT_RUNNING,
+  /** The quantum is over, yield at the next check. */
+  CORO_PREEMPT_EXPIRED,
+};
+
+/** Timer period in microseconds. 0, if preemption is off. */
+static long long coro_preempt_tick = 0;
+/** Preemption state of this thread, enum coro_preempt_state. */
+static __thread volatile sig_atomic_t coro_preempt_state = CORO_PREEMPT_OFF;
+/** Ticks left until the current quantum end. */
+static __thread volatile sig_atomic_t coro_preempt_ticks_left = 0;
+/** The timer of this thread. Valid if the state is not OFF. */
+static __thread timer_t coro_preempt_timer;
+
+#ifdef CORO_SWITCH_SIGJMP
 /**
  * Buffer, used by the coroutine constructor to escape from the
  * signal handler back into the constructor to rollback
@@ -81,26 +375,284 @@ static struct coro *coro_list = NULL;
  */
 static sigjmp_buf start_point;
 
-/** Add a new coroutine to the beginning of the list. */
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to) {
+  if (sigsetjmp(from->buf, 0) == 0)
+    siglongjmp(to->buf, 1);
+}
+#endif
+
+/**
+ * Requested stack size for new coroutines. The coroutine object
+ * and the guard page are placed in the same mapping on top of it.
+ */
+static size_t coro_stack_size = 1024 * 1024;
+/** Size of the PROT_NONE page below each stack. 0 - no guard. */
+static size_t coro_stack_guard = (size_t)-1;
+/**
+ * Stack mappings of deleted coroutines, ready for reuse. Linked
+ * via the 'next' member of the coroutine living on each stack.
+ */
+static struct coro *coro_stack_pool = NULL;
+/** Protects the pool, coroutines are created by any worker. */
+static pthread_mutex_t coro_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Stack statistics, see struct coro_stack_stat. */
+static size_t coro_stack_mapped_count = 0;
+static size_t coro_stack_cached_count = 0;
+static size_t coro_stack_mapped_size = 0;
+
+/**
+ * The shared stack mode. All the coroutines run on one stack, which
+ * holds the stack of one of them - the owner. Another coroutine is
+ * copied in only when it is resumed, so switching between a
+ * coroutine and the scheduler costs no copies. The stacks can't be
+ * exchanged while running on the shared stack - that is done by the
+ * copier, a context with its own small stack. Only one thread runs
+ * coroutines in this mode, no locks are needed.
+ */
+struct coro_shared_stack {
+  bool is_on;
+  /** The mapping, starting with a guard page. */
+  char *map;
+  size_t map_size;
+  /** The stacks are copied in just below the top. */
+  char *top;
+  /** The coroutine whose stack is on the shared one. */
+  struct coro *owner;
+  /** The coroutine to copy in and resume, for the copier. */
+  struct coro *next;
+  struct coro_ctx copier_ctx;
+  void *copier_stack;
+  /** Total capacity of the save buffers, for the statistics. */
+  size_t saved_size;
+};
+
+static struct coro_shared_stack coro_shared_stack;
+
+/** Stack of the copier, it only calls memcpy() and realloc(). */
+enum { CORO_SHARED_COPIER_STACK_SIZE = 64 * 1024 };
+
+static size_t
+coro_page_size(void) {
+  static size_t page_size = 0;
+  if (page_size == 0)
+    page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+/**
+ * Take a stack mapping from the pool or map a new one. Returns the
+ * coroutine object placed on top of the stack.
+ */
+static struct coro *
+coro_stack_new(void) {
+  pthread_mutex_lock(&coro_stack_lock);
+  if (coro_stack_pool != NULL) {
+    struct coro *c = coro_stack_pool;
+    coro_stack_pool = c->next;
+    --coro_stack_cached_count;
+    pthread_mutex_unlock(&coro_stack_lock);
+    return c;
+  }
+  pthread_mutex_unlock(&coro_stack_lock);
+  size_t page_size = coro_page_size();
+  if (coro_stack_guard == (size_t)-1)
+    coro_stack_guard = page_size;
+  size_t stack_size = coro_stack_size;
+#ifdef CORO_SWITCH_SIGJMP
+  /* SIGSTKSZ is a sysconf() call with _GNU_SOURCE in new glibc. */
+  if (stack_size < (size_t)SIGSTKSZ)
+    stack_size = SIGSTKSZ;
+#endif
+  size_t size = stack_size + sizeof(struct coro) + coro_stack_guard;
+  size = (size + page_size - 1) & ~(page_size - 1);
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  if (coro_stack_guard != 0 &&
+      mprotect(map, coro_stack_guard, PROT_NONE) != 0) {
+    munmap(map, size);
+    return NULL;
+  }
+  uintptr_t top = (uintptr_t)map + size - sizeof(struct coro);
+  struct coro *c = (struct coro *)(top & ~(uintptr_t)63);
+  c->stack = map;
+  c->stack_size = size;
+  c->saved = NULL;
+  c->saved_capacity = 0;
+  pthread_mutex_lock(&coro_stack_lock);
+  ++coro_stack_mapped_count;
+  coro_stack_mapped_size += size;
+  pthread_mutex_unlock(&coro_stack_lock);
+  return c;
+}
+
+/** Return a stack mapping to the pool. */
 static void
-coro_list_add(struct coro *c) {
-  c->next = coro_list;
-  c->prev = NULL;
-  if (coro_list != NULL)
-    coro_list->prev = c;
-  coro_list = c;
+coro_stack_delete(struct coro *c) {
+  pthread_mutex_lock(&coro_stack_lock);
+  c->next = coro_stack_pool;
+  coro_stack_pool = c;
+  ++coro_stack_cached_count;
+  pthread_mutex_unlock(&coro_stack_lock);
+}
+
+/** Unmap all the cached stacks. */
+static void
+coro_stack_pool_drain(void) {
+  pthread_mutex_lock(&coro_stack_lock);
+  while (coro_stack_pool != NULL) {
+    struct coro *c = coro_stack_pool;
+    coro_stack_pool = c->next;
+    --coro_stack_cached_count;
+    --coro_stack_mapped_count;
+    coro_stack_mapped_size -= c->stack_size;
+    munmap(c->stack, c->stack_size);
+  }
+  pthread_mutex_unlock(&coro_stack_lock);
+}
+
+void coro_sched_set_stack_size(size_t size) {
+  coro_stack_pool_drain();
+  coro_stack_size = size;
+}
+
+void coro_sched_set_stack_guard(bool enable) {
+  coro_stack_pool_drain();
+  coro_stack_guard = enable ? coro_page_size() : 0;
+}
+
+void coro_stack_stat(struct coro_stack_stat *stat) {
+  pthread_mutex_lock(&coro_stack_lock);
+  stat->mapped_count = coro_stack_mapped_count;
+  stat->cached_count = coro_stack_cached_count;
+  stat->mapped_size = coro_stack_mapped_size;
+  pthread_mutex_unlock(&coro_stack_lock);
+  stat->saved_size = coro_shared_stack.saved_size;
+  stat->rss = 0;
+  /* The second field is the resident set size in pages. */
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL)
+    return;
+  unsigned long size, resident;
+  if (fscanf(f, "%lu %lu", &size, &resident) == 2)
+    stat->rss = resident * coro_page_size();
+  fclose(f);
 }
 
-/** Remove a coroutine from the list. */
+/** Append a coroutine to the end of the queue. */
 static void
-coro_list_delete(struct coro *c) {
+coro_queue_push(struct coro_queue *q, struct coro *c) {
+  c->next = NULL;
+  c->prev = q->tail;
+  if (q->tail != NULL)
+    q->tail->next = c;
+  else
+    q->head = c;
+  q->tail = c;
+}
+
+/** Remove a coroutine from any place of the queue. */
+static void
+coro_queue_delete(struct coro_queue *q, struct coro *c) {
   struct coro *prev = c->prev, *next = c->next;
   if (prev != NULL)
     prev->next = next;
+  else
+    q->head = next;
   if (next != NULL)
     next->prev = prev;
-  if (prev == NULL)
-    coro_list = next;
+  else
+    q->tail = prev;
+  c->next = NULL;
+  c->prev = NULL;
+}
+
+/** Take the first coroutine from the queue. NULL, if empty. */
+static struct coro *
+coro_queue_pop(struct coro_queue *q) {
+  struct coro *c = q->head;
+  if (c != NULL)
+    coro_queue_delete(q, c);
+  return c;
+}
+
+/** Make a coroutine ready to run on the given scheduler. */
+static void
+coro_ready_push(struct coro_worker *w, struct coro *c) {
+  if (coro_worker_count == 0) {
+    coro_queue_push(&w->ready, c);
+    return;
+  }
+  pthread_mutex_lock(&w->lock);
+  coro_queue_push(&w->ready, c);
+  pthread_mutex_unlock(&w->lock);
+  /*
+   * Either an idle worker sees the new counter before sleeping,
+   * or it is already counted as idle and is woken up here.
+   */
+  __atomic_add_fetch(&coro_mt_ready_count, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&coro_mt_idle_count, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&coro_mt_lock);
+    pthread_cond_signal(&coro_mt_work_cond);
+    pthread_mutex_unlock(&coro_mt_lock);
+  }
+}
+
+/** Take the next coroutine to run from the given scheduler. */
+static struct coro *
+coro_ready_pop(struct coro_worker *w) {
+  if (coro_worker_count == 0)
+    return coro_queue_pop(&w->ready);
+  pthread_mutex_lock(&w->lock);
+  struct coro *c = coro_queue_pop(&w->ready);
+  pthread_mutex_unlock(&w->lock);
+  if (c != NULL)
+    __atomic_sub_fetch(&coro_mt_ready_count, 1, __ATOMIC_SEQ_CST);
+  return c;
+}
+
+#ifndef CORO_SWITCH_SIGJMP
+
+/**
+ * Steal a ready coroutine from another worker. The victim's most
+ * recently queued one is taken, its own next one is left alone.
+ */
+static struct coro *
+coro_ready_steal(struct coro_worker *w) {
+  int self = w - coro_workers;
+  for (int i = 1; i < coro_worker_count; ++i) {
+    struct coro_worker *victim =
+        &coro_workers[(self + i) % coro_worker_count];
+    pthread_mutex_lock(&victim->lock);
+    struct coro *c = victim->ready.tail;
+    if (c != NULL)
+      coro_queue_delete(&victim->ready, c);
+    pthread_mutex_unlock(&victim->lock);
+    if (c != NULL) {
+      __atomic_sub_fetch(&coro_mt_ready_count, 1, __ATOMIC_SEQ_CST);
+      return c;
+    }
+  }
+  return NULL;
+}
+
+#endif /* !CORO_SWITCH_SIGJMP */
+
+/** Hand a finished coroutine to coro_sched_wait(). */
+static void
+coro_finished_push(struct coro *c) {
+  if (coro_worker_count == 0) {
+    coro_queue_push(&coro_finished, c);
+    --coro_live_count;
+    return;
+  }
+  pthread_mutex_lock(&coro_mt_lock);
+  coro_queue_push(&coro_finished, c);
+  --coro_live_count;
+  pthread_cond_signal(&coro_mt_finished_cond);
+  pthread_mutex_unlock(&coro_mt_lock);
 }
 
 int coro_status(const struct coro *c) {
@@ -113,7 +665,17 @@ coro_switch_count(const struct coro *c) {
 }
 long long
 coro_total_time_working(const struct coro *c) {
-  return c->total_time_working;
+  return coro_clock_to_us(c->total_time_working);
+}
+
+void coro_time_stat(struct coro *c, struct coro_time_stat *stat) {
+  long long time[CORO_TRACE_STATE_COUNT];
+  memcpy(time, c->trace_time, sizeof(time));
+  if (coro_trace_is_on && c->trace_state >= 0)
+    time[c->trace_state] += coro_clock_now() - c->trace_since;
+  stat->cpu_us = coro_clock_to_us(time[CORO_TRACE_RUNNING]);
+  stat->ready_us = coro_clock_to_us(time[CORO_TRACE_READY]);
+  stat->blocked_us = coro_clock_to_us(time[CORO_TRACE_BLOCKED]);
 }
 
 bool coro_is_finished(const struct coro *c) {
@@ -121,10 +683,225 @@ bool coro_is_finished(const struct coro *c) {
 }
 
 void coro_delete(struct coro *c) {
-  free(c->stack);
-  free(c);
+  if (c->stack == NULL) {
+    /* From the shared stack mode. */
+    coro_shared_stack.saved_size -= c->saved_capacity;
+    free(c->saved);
+    free(c);
+    return;
+  }
+  coro_stack_delete(c);
+}
+
+static void
+coro_preempt_on_tick(int signum) {
+  (void)signum;
+  if (coro_preempt_state == CORO_PREEMPT_RUNNING &&
+      --coro_preempt_ticks_left <= 0)
+    coro_preempt_state = CORO_PREEMPT_EXPIRED;
+}
+
+/** Start the preemption timer ticking in the current thread. */
+static int
+coro_preempt_thread_start(void) {
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGALRM;
+  sev.sigev_notify_thread_id = gettid();
+  if (timer_create(CLOCK_MONOTONIC, &sev, &coro_preempt_timer) != 0)
+    return -1;
+  struct itimerspec its;
+  its.it_interval.tv_sec = coro_preempt_tick / 1000000;
+  its.it_interval.tv_nsec = coro_preempt_tick % 1000000 * 1000;
+  its.it_value = its.it_interval;
+  if (timer_settime(coro_preempt_timer, 0, &its, NULL) != 0) {
+    timer_delete(coro_preempt_timer);
+    return -1;
+  }
+  coro_preempt_ticks_left = 1;
+  coro_preempt_state = CORO_PREEMPT_RUNNING;
+  return 0;
+}
+
+/** Stop the preemption timer of the current thread. */
+static void
+coro_preempt_thread_stop(void) {
+  if (coro_preempt_state == CORO_PREEMPT_OFF)
+    return;
+  coro_preempt_state = CORO_PREEMPT_OFF;
+  timer_delete(coro_preempt_timer);
+}
+
+/** Start a new quantum for the coroutine getting the control. */
+static inline void
+coro_preempt_arm(const struct coro *c) {
+  if (coro_preempt_state == CORO_PREEMPT_OFF)
+    return;
+  long long ticks = coro_clock_to_us(c->full_timeperiod) / coro_preempt_tick;
+  coro_preempt_ticks_left = ticks > 0 ? ticks : 1;
+  coro_preempt_state = CORO_PREEMPT_RUNNING;
+}
+
+int coro_sched_start_preempt(long long tick_us) {
+  if (tick_us <= 0 || coro_preempt_tick != 0 || coro_worker_count != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = coro_preempt_on_tick;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGALRM, &sa, NULL) != 0)
+    return -1;
+  coro_preempt_tick = tick_us;
+  if (coro_preempt_thread_start() != 0) {
+    coro_preempt_tick = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/** Thread number for the trace: 0 - main, N - worker N. */
+static unsigned
+coro_trace_thread(void) {
+  struct coro_worker *w = coro_worker_ptr;
+  if (w == NULL || w == &coro_main)
+    return 0;
+  return w - coro_workers + 1;
+}
+
+/**
+ * Account the time of the coroutine's current state and trace the
+ * new one. Must be done before the coroutine is handed to a queue,
+ * where another thread could change its state again.
+ */
+static inline void
+coro_trace_change(struct coro *c, enum coro_trace_state state) {
+  if (!coro_trace_is_on || c->trace_state < 0)
+    return;
+  long long now = coro_clock_now();
+  c->trace_time[c->trace_state] += now - c->trace_since;
+  c->trace_since = now;
+  c->trace_state = state;
+  coro_trace_record(c->id, state, coro_trace_thread(), now);
+}
+
+/**
+ * Called right after a switch by the one who got the control. The
+ * previous coroutine's context is saved now, and it can be handed
+ * to the queues. Not inlined to make the compiler re-read the
+ * thread-local variables - in M:N mode the coroutine could have
+ * been resumed in a different thread.
+ */
+static __attribute__((noinline)) void
+coro_switch_done(struct coro *this) {
+  coro_this_ptr = this;
+  coro_preempt_arm(this);
+  struct coro_worker *w = coro_worker_ptr;
+  if (this != &w->sched)
+    coro_trace_change(this, CORO_TRACE_RUNNING);
+  struct coro *c = w->to_ready;
+  if (c != NULL) {
+    w->to_ready = NULL;
+    coro_trace_change(c, CORO_TRACE_READY);
+    coro_ready_push(w, c);
+  }
+  c = w->to_finished;
+  if (c != NULL) {
+    w->to_finished = NULL;
+    coro_trace_change(c, CORO_TRACE_FINISHED);
+    coro_finished_push(c);
+  }
+  c = w->to_suspended;
+  if (c != NULL) {
+    w->to_suspended = NULL;
+    coro_trace_change(c, CORO_TRACE_BLOCKED);
+    int state = CORO_WAKE_SUSPENDING;
+    if (!__atomic_compare_exchange_n(&c->wake_state, &state,
+                                     CORO_WAKE_SUSPENDED, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      /* Woken up while was switching away. */
+      assert(state == CORO_WAKE_PENDING);
+      __atomic_store_n(&c->wake_state, CORO_WAKE_RUNNABLE, __ATOMIC_SEQ_CST);
+      coro_trace_change(c, CORO_TRACE_READY);
+      coro_ready_push(w, c);
+    }
+  }
+}
+
+#ifndef CORO_SWITCH_SIGJMP
+
+/** Save the owner's stack and copy the one of @a c in its place. */
+static void
+coro_shared_stack_swap(struct coro *c) {
+  struct coro_shared_stack *s = &coro_shared_stack;
+  struct coro *owner = s->owner;
+  if (owner != NULL) {
+    size_t size = s->top - (char *)owner->ctx.sp;
+    if (size > owner->saved_capacity) {
+      char *saved = realloc(owner->saved, size);
+      if (saved == NULL)
+        handle_error();
+      s->saved_size += size - owner->saved_capacity;
+      owner->saved = saved;
+      owner->saved_capacity = size;
+    }
+    memcpy(owner->saved, owner->ctx.sp, size);
+  }
+  memcpy(c->ctx.sp, c->saved, s->top - (char *)c->ctx.sp);
+  s->owner = c;
+}
+
+/** Body of the copier: swap the next coroutine in and resume it. */
+static void
+coro_shared_copier(void *arg) {
+  (void)arg;
+  while (true) {
+    struct coro *c = coro_shared_stack.next;
+    coro_shared_stack_swap(c);
+    coro_ctx_switch(&coro_shared_stack.copier_ctx, &c->ctx);
+  }
+}
+
+/**
+ * Switch in the shared stack mode. If @a to is not on the shared
+ * stack, it is copied in - right here, when not running on the
+ * shared stack, or by the copier otherwise.
+ */
+static void
+coro_shared_switch(struct coro *from, struct coro *to) {
+  struct coro_shared_stack *s = &coro_shared_stack;
+  if (to == &coro_main.sched || to == s->owner) {
+    coro_ctx_switch(&from->ctx, &to->ctx);
+  } else if (from == &coro_main.sched) {
+    coro_shared_stack_swap(to);
+    coro_ctx_switch(&from->ctx, &to->ctx);
+  } else {
+    s->next = to;
+    coro_ctx_switch(&from->ctx, &s->copier_ctx);
+  }
 }
 
+/** Free the shared stack and the copier. */
+static void
+coro_shared_stack_destroy(void) {
+  struct coro_shared_stack *s = &coro_shared_stack;
+  if (!s->is_on)
+    return;
+  pthread_mutex_lock(&coro_stack_lock);
+  --coro_stack_mapped_count;
+  coro_stack_mapped_size -= s->map_size;
+  pthread_mutex_unlock(&coro_stack_lock);
+  munmap(s->map, s->map_size);
+  free(s->copier_stack);
+  s->is_on = false;
+  s->owner = NULL;
+}
+
+#endif /* !CORO_SWITCH_SIGJMP */
+
 /** Switch the current coroutine to an arbitrary one. */
 static void
 coro_yield_to(struct coro *to) {
@@ -133,45 +910,298 @@ coro_yield_to(struct coro *to) {
 
   // ADDED BY STUDENT
   //
-  struct timespec t_time;
-  clock_gettime(CLOCK_MONOTONIC, &t_time);
-  to->last_checked_at = t_time.tv_sec * 1000000 + t_time.tv_nsec / 1000;
+  long long current_ts = coro_clock_now();
+  from->total_time_working += current_ts - from->last_checked_at;
+  from->last_checked_at = current_ts;
+  to->last_checked_at = current_ts;
   //
   // ADDED BY STUDENT
 
-  if (sigsetjmp(from->ctx, 0) == 0)
-    siglongjmp(to->ctx, 1);
-  coro_this_ptr = from;
+#ifndef CORO_SWITCH_SIGJMP
+  if (coro_shared_stack.is_on)
+    coro_shared_switch(from, to);
+  else
+#endif
+    coro_ctx_switch(&from->ctx, &to->ctx);
+  coro_switch_done(from);
+}
+
+/**
+ * Check the poller of the scheduler for new wakeups.
+ * @param timeout_ms 0 - don't block, -1 - block until an event.
+ * @retval -1 Nothing to wait for - no poller or nothing in flight.
+ * @retval >= 0 Number of woken coroutines.
+ */
+static inline int
+coro_poll(struct coro_worker *w, int timeout_ms) {
+  if (w->poll == NULL)
+    return -1;
+  return w->poll(w->poll_arg, timeout_ms);
+}
+
+void coro_sched_set_poller(coro_poll_f poll, void (*destroy)(void *arg),
+                           void *arg) {
+  struct coro_worker *w = coro_worker_ptr;
+  assert(w->poll == NULL || poll == NULL);
+  w->poll = poll;
+  w->poll_destroy = destroy;
+  w->poll_arg = arg;
+}
+
+/** Destroy the poller of the current thread's scheduler. */
+static void
+coro_poller_destroy(void) {
+  struct coro_worker *w = coro_worker_ptr;
+  if (w == NULL || w->poll == NULL)
+    return;
+  w->poll = NULL;
+  if (w->poll_destroy != NULL)
+    w->poll_destroy(w->poll_arg);
+}
+
+void coro_suspend(void) {
+  struct coro *c = coro_this_ptr;
+  struct coro_worker *w = coro_worker_ptr;
+  assert(c != &w->sched);
+  int state = CORO_WAKE_RUNNABLE;
+  if (!__atomic_compare_exchange_n(&c->wake_state, &state,
+                                   CORO_WAKE_SUSPENDING, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    /* The wakeup has already come. */
+    assert(state == CORO_WAKE_PENDING);
+    __atomic_store_n(&c->wake_state, CORO_WAKE_RUNNABLE, __ATOMIC_SEQ_CST);
+    return;
+  }
+  coro_poll(w, 0);
+  struct coro *to = coro_ready_pop(w);
+  if (to == NULL)
+    to = &w->sched;
+  w->to_suspended = c;
+  coro_yield_to(to);
+}
+
+void coro_wakeup(struct coro *c) {
+  int state = __atomic_load_n(&c->wake_state, __ATOMIC_SEQ_CST);
+  while (true) {
+    int new_state;
+    switch (state) {
+      case CORO_WAKE_SUSPENDED:
+        new_state = CORO_WAKE_RUNNABLE;
+        break;
+      case CORO_WAKE_RUNNABLE:
+      case CORO_WAKE_SUSPENDING:
+        new_state = CORO_WAKE_PENDING;
+        break;
+      default:
+        return;
+    }
+    if (__atomic_compare_exchange_n(&c->wake_state, &state, new_state,
+                                    false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST))
+      break;
+  }
+  if (state != CORO_WAKE_SUSPENDED)
+    return;
+  coro_trace_change(c, CORO_TRACE_READY);
+  struct coro_worker *w = coro_worker_ptr;
+  if (coro_worker_count > 0 && w == &coro_main) {
+    unsigned i = __atomic_fetch_add(&coro_mt_next_worker, 1,
+                                    __ATOMIC_RELAXED);
+    w = &coro_workers[i % coro_worker_count];
+  }
+  coro_ready_push(w, c);
 }
 
 void coro_yield(void) {
   struct coro *from = coro_this_ptr;
-  struct coro *to = from->next;
+  struct coro_worker *w = coro_worker_ptr;
+  if (from == &w->sched)
+    return;
+  coro_poll(w, 0);
+  /*
+   * Go straight to the next ready coroutine. The scheduler gets
+   * the control back only when something finishes.
+   */
+  struct coro *to = coro_ready_pop(w);
   if (to == NULL)
-    coro_yield_to(&coro_sched);
-  else
-    coro_yield_to(to);
+    return;
+  w->to_ready = from;
+  coro_yield_to(to);
+}
+
+void yield_if_period_end() {
+  sig_atomic_t state = coro_preempt_state;
+  if (state == CORO_PREEMPT_RUNNING)
+    return;
+  if (state == CORO_PREEMPT_EXPIRED) {
+    /* Re-armed here in case there is nobody to yield to. */
+    coro_preempt_arm(coro_this_ptr);
+    coro_yield();
+    return;
+  }
+  struct coro *this = coro_this();
+
+  long long current_ts = coro_clock_now();
+
+  long long coro_worked = current_ts - this->last_checked_at;
+  this->last_checked_at = current_ts;
+
+  this->total_time_working += coro_worked;
+  this->left_timeperiod = this->left_timeperiod - coro_worked;
+  if (this->left_timeperiod < 0) {
+    this->left_timeperiod = this->full_timeperiod;
+    coro_yield();
+    return;
+  }
 }
 
 void coro_sched_init(void) {
-  memset(&coro_sched, 0, sizeof(coro_sched));
-  coro_this_ptr = &coro_sched;
+  coro_clock_init();
+  memset(&coro_main.sched, 0, sizeof(coro_main.sched));
+  coro_worker_ptr = &coro_main;
+  coro_this_ptr = &coro_main.sched;
+}
+
+#ifndef CORO_SWITCH_SIGJMP
+
+/** Worker thread main loop: run own, stolen or sleep. */
+static void *
+coro_worker_f(void *arg) {
+  struct coro_worker *w = arg;
+  coro_worker_ptr = w;
+  coro_this_ptr = &w->sched;
+  if (coro_preempt_tick != 0 && coro_preempt_thread_start() != 0)
+    handle_error();
+  while (true) {
+    struct coro *c = coro_ready_pop(w);
+    if (c == NULL)
+      c = coro_ready_steal(w);
+    if (c != NULL) {
+      coro_yield_to(c);
+      continue;
+    }
+    /*
+     * Only this worker can harvest its own external events. While
+     * some are in flight, sleep in the poller, but not for long -
+     * new work can appear in the other queues.
+     */
+    int rc = coro_poll(w, 0);
+    if (rc > 0)
+      continue;
+    if (rc == 0) {
+      coro_poll(w, 1);
+      continue;
+    }
+    pthread_mutex_lock(&coro_mt_lock);
+    __atomic_add_fetch(&coro_mt_idle_count, 1, __ATOMIC_SEQ_CST);
+    while (!coro_mt_is_stopped &&
+           __atomic_load_n(&coro_mt_ready_count, __ATOMIC_SEQ_CST) == 0)
+      pthread_cond_wait(&coro_mt_work_cond, &coro_mt_lock);
+    __atomic_sub_fetch(&coro_mt_idle_count, 1, __ATOMIC_SEQ_CST);
+    bool is_stopped = coro_mt_is_stopped;
+    pthread_mutex_unlock(&coro_mt_lock);
+    if (is_stopped) {
+      coro_preempt_thread_stop();
+      coro_poller_destroy();
+      return NULL;
+    }
+  }
+}
+
+#endif /* !CORO_SWITCH_SIGJMP */
+
+int coro_sched_start_workers(int count) {
+#ifdef CORO_SWITCH_SIGJMP
+  /*
+   * Jump buffers can't be resumed in another thread, and the
+   * stack creation changes process-wide signal handlers.
+   */
+  (void)count;
+  errno = ENOTSUP;
+  return -1;
+#else
+  if (count <= 0 || coro_worker_count != 0 || coro_main.ready.head != NULL ||
+      coro_shared_stack.is_on) {
+    errno = EINVAL;
+    return -1;
+  }
+  coro_workers = calloc(count, sizeof(*coro_workers));
+  if (coro_workers == NULL)
+    return -1;
+  for (int i = 0; i < count; ++i)
+    pthread_mutex_init(&coro_workers[i].lock, NULL);
+  coro_mt_is_stopped = false;
+  coro_worker_count = count;
+  /* The workers tick on their own, this thread doesn't run coroutines. */
+  coro_preempt_thread_stop();
+  for (int i = 0; i < count; ++i) {
+    struct coro_worker *w = &coro_workers[i];
+    if (pthread_create(&w->thread, NULL, coro_worker_f, w) != 0)
+      handle_error();
+  }
+  return 0;
+#endif
+}
+
+/** Stop and join the worker threads, leave M:N mode. */
+static void
+coro_sched_stop_workers(void) {
+  if (coro_worker_count == 0)
+    return;
+  pthread_mutex_lock(&coro_mt_lock);
+  coro_mt_is_stopped = true;
+  pthread_cond_broadcast(&coro_mt_work_cond);
+  pthread_mutex_unlock(&coro_mt_lock);
+  for (int i = 0; i < coro_worker_count; ++i) {
+    pthread_join(coro_workers[i].thread, NULL);
+    pthread_mutex_destroy(&coro_workers[i].lock);
+  }
+  free(coro_workers);
+  coro_workers = NULL;
+  coro_worker_count = 0;
+}
+
+void coro_sched_destroy(void) {
+  coro_sched_stop_workers();
+  coro_preempt_thread_stop();
+  coro_poller_destroy();
+  coro_preempt_tick = 0;
+  coro_stack_pool_drain();
+#ifndef CORO_SWITCH_SIGJMP
+  coro_shared_stack_destroy();
+#endif
 }
 
 struct coro *
 coro_sched_wait(void) {
-  while (coro_list != NULL) {
-    for (struct coro *c = coro_list; c != NULL; c = c->next) {
-      if (c->is_finished) {
-        coro_list_delete(c);
-        return c;
+  if (coro_worker_count > 0) {
+    pthread_mutex_lock(&coro_mt_lock);
+    while (coro_finished.head == NULL && coro_live_count > 0)
+      pthread_cond_wait(&coro_mt_finished_cond, &coro_mt_lock);
+    struct coro *c = coro_queue_pop(&coro_finished);
+    pthread_mutex_unlock(&coro_mt_lock);
+    return c;
+  }
+  while (true) {
+    struct coro *c = coro_queue_pop(&coro_finished);
+    if (c != NULL)
+      return c;
+    coro_poll(&coro_main, 0);
+    c = coro_queue_pop(&coro_main.ready);
+    if (c == NULL) {
+      if (coro_live_count == 0)
+        return NULL;
+      /* All the alive coroutines are suspended. */
+      if (coro_poll(&coro_main, -1) < 0) {
+        printf("Critical error - suspended forever!\n");
+        return NULL;
       }
+      continue;
     }
     is_sched_waiting = true;
-    coro_yield_to(coro_list);
+    coro_yield_to(c);
     is_sched_waiting = false;
   }
-  return NULL;
 }
 
 struct coro *
@@ -179,6 +1209,50 @@ coro_this(void) {
   return coro_this_ptr;
 }
 
+void *
+coro_wait_slot(struct coro *c) {
+  return c->wait_slot;
+}
+
+bool coro_is_sched(void) {
+  return coro_this_ptr == &coro_worker_ptr->sched;
+}
+
+/**
+ * Coroutine main function. Runs the user's function and returns
+ * the control to the scheduler forever.
+ */
+static void
+coro_body(struct coro *c) {
+  coro_switch_done(c);
+  c->ret = c->func(c->func_arg);
+  c->is_finished = true;
+
+  // CALCULATE TIME
+  long long current_ts = coro_clock_now();
+  long long coro_worked = current_ts - c->last_checked_at;
+
+  c->total_time_working += coro_worked;
+  c->last_checked_at = current_ts;
+  // CALCULATE TIME
+
+  /* Can not return - 'ret' address is invalid already! */
+  if (coro_worker_count == 0 && !is_sched_waiting) {
+    printf("Critical error - no place to return!\n");
+    exit(-1);
+  }
+  struct coro_worker *w = coro_worker_ptr;
+  w->to_finished = c;
+  /* The stack is not needed anymore, don't save it. */
+  if (coro_shared_stack.owner == c)
+    coro_shared_stack.owner = NULL;
+  coro_ctx_switch(&c->ctx, &w->sched.ctx);
+  /* Finished coroutines are never resumed. */
+  abort();
+}
+
+#ifdef CORO_SWITCH_SIGJMP
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -186,7 +1260,7 @@ coro_this(void) {
  * coroutine constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum) {
+coro_body_signal(int signum) {
   (void)signum;
   struct coro *c = coro_this_ptr;
   coro_this_ptr = NULL;
@@ -194,50 +1268,18 @@ coro_body(int signum) {
    * On an invokation jump back to the constructor right
    * after remembering the context.
    */
-  if (sigsetjmp(c->ctx, 0) == 0)
+  if (sigsetjmp(c->ctx.buf, 0) == 0)
     siglongjmp(start_point, 1);
   /*
    * If the execution is here, then the coroutine should
    * finaly start work.
    */
-  coro_this_ptr = c;
-  c->ret = c->func(c->func_arg);
-  c->is_finished = true;
-
-  // CALCULATE TIME
-  struct timespec t_time;
-  clock_gettime(CLOCK_MONOTONIC, &t_time);
-  long long current_ts = (t_time.tv_sec * 1000000 + t_time.tv_nsec / 1000);
-  long long coro_worked = current_ts - c->last_checked_at;
-
-  c->total_time_working += coro_worked;
-  c->last_checked_at = current_ts;
-  // CALCULATE TIME
-
-  /* Can not return - 'ret' address is invalid already! */
-  if (!is_sched_waiting) {
-    printf("Critical error - no place to return!\n");
-    exit(-1);
-  }
-  siglongjmp(coro_sched.ctx, 1);
+  coro_body(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg, int quant_time) {
-  struct coro *c = (struct coro *)malloc(sizeof(*c));
-  c->ret = 0;
-  int stack_size = 1024 * 1024;
-  if (stack_size < SIGSTKSZ)
-    stack_size = SIGSTKSZ;
-  c->stack = malloc(stack_size);
-  c->func = func;
-  c->func_arg = func_arg;
-  c->is_finished = false;
-  c->switch_count = 0;
-  c->left_timeperiod = quant_time;
-  c->full_timeperiod = quant_time;
-  c->total_time_working = 0;
-
+/** Prepare the context to start coro_body() on a new stack. */
+static void
+coro_ctx_make(struct coro *c, void *stack, size_t stack_size) {
   /*
    * SIGUSR2 is used. First of all, block new signals to be
    * able to set a new handler.
@@ -253,14 +1295,14 @@ coro_new(coro_f func, void *func_arg, int quant_time) {
    * becomes dedicated to that single coroutine.
    */
   struct sigaction newsa, oldsa;
-  newsa.sa_handler = coro_body;
+  newsa.sa_handler = coro_body_signal;
   newsa.sa_flags = SA_ONSTACK;
   sigemptyset(&newsa.sa_mask);
   if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
     handle_error();
   /* Create that new stack. */
   stack_t oldst, newst;
-  newst.ss_sp = c->stack;
+  newst.ss_sp = stack;
   newst.ss_size = stack_size;
   newst.ss_flags = 0;
   if (sigaltstack(&newst, &oldst) != 0)
@@ -293,8 +1335,166 @@ coro_new(coro_f func, void *func_arg, int quant_time) {
     handle_error();
   if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
     handle_error();
+}
+
+#else /* !CORO_SWITCH_SIGJMP */
+
+/**
+ * Fill the initial frame of a context, looking as if
+ * coro_ctx_switch() was called from coro_ctx_entry(), which is
+ * going to call @a func with @a arg.
+ */
+static void
+coro_ctx_fill_frame(void **frame, void *func, void *arg) {
+  memset(frame, 0, CORO_CTX_FRAME_SLOTS * sizeof(*frame));
+  frame[CORO_CTX_REG_ARG] = arg;
+  frame[CORO_CTX_REG_FUNC] = func;
+  frame[CORO_CTX_REG_RET] = (void *)coro_ctx_entry;
+}
+
+/**
+ * Prepare the context to start coro_body() on a new stack. A
+ * fake frame is put on top of the stack, looking as if
+ * coro_ctx_switch() was called from coro_ctx_entry(). The first
+ * switch to the coroutine pops it and "returns" into the entry.
+ */
+static void
+coro_ctx_make(struct coro *c, void *stack, size_t stack_size) {
+  uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+  void **frame = (void **)top - CORO_CTX_FRAME_SLOTS;
+  coro_ctx_fill_frame(frame, (void *)coro_body, c);
+  c->ctx.sp = frame;
+}
+
+/**
+ * Create a coroutine object for the shared stack mode. Its initial
+ * frame is put into the save buffer, and is copied onto the shared
+ * stack when the coroutine is started.
+ */
+static struct coro *
+coro_shared_new(void) {
+  struct coro *c = malloc(sizeof(*c));
+  size_t size = CORO_CTX_FRAME_SLOTS * sizeof(void *);
+  char *saved = malloc(size);
+  if (c == NULL || saved == NULL) {
+    free(c);
+    free(saved);
+    return NULL;
+  }
+  c->stack = NULL;
+  c->stack_size = 0;
+  c->saved = saved;
+  c->saved_capacity = size;
+  coro_shared_stack.saved_size += size;
+  coro_ctx_fill_frame((void **)saved, (void *)coro_body, c);
+  c->ctx.sp = coro_shared_stack.top - size;
+  return c;
+}
 
-  /* Now scheduler can work with that coroutine. */
-  coro_list_add(c);
+#endif /* !CORO_SWITCH_SIGJMP */
+
+int coro_sched_set_shared_stack(bool enable) {
+#ifdef CORO_SWITCH_SIGJMP
+  (void)enable;
+  errno = ENOTSUP;
+  return -1;
+#else
+  struct coro_shared_stack *s = &coro_shared_stack;
+  if (coro_live_count != 0 || coro_worker_count != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!enable) {
+    coro_shared_stack_destroy();
+    return 0;
+  }
+  if (s->is_on)
+    return 0;
+  size_t page_size = coro_page_size();
+  size_t size = (coro_stack_size + page_size - 1) / page_size * page_size +
+                page_size;
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  void *copier_stack = malloc(CORO_SHARED_COPIER_STACK_SIZE);
+  if (copier_stack == NULL || mprotect(map, page_size, PROT_NONE) != 0) {
+    free(copier_stack);
+    munmap(map, size);
+    return -1;
+  }
+  s->map = map;
+  s->map_size = size;
+  s->top = map + size;
+  s->owner = NULL;
+  s->copier_stack = copier_stack;
+  uintptr_t top = ((uintptr_t)copier_stack + CORO_SHARED_COPIER_STACK_SIZE) &
+                  ~(uintptr_t)15;
+  void **frame = (void **)top - CORO_CTX_FRAME_SLOTS;
+  coro_ctx_fill_frame(frame, (void *)coro_shared_copier, NULL);
+  s->copier_ctx.sp = frame;
+  s->is_on = true;
+  pthread_mutex_lock(&coro_stack_lock);
+  ++coro_stack_mapped_count;
+  coro_stack_mapped_size += size;
+  pthread_mutex_unlock(&coro_stack_lock);
+  return 0;
+#endif
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg, int quant_time) {
+  struct coro *c;
+#ifndef CORO_SWITCH_SIGJMP
+  if (coro_shared_stack.is_on)
+    c = coro_shared_new();
+  else
+#endif
+    c = coro_stack_new();
+  if (c == NULL)
+    return NULL;
+  c->ret = 0;
+  c->func = func;
+  c->func_arg = func_arg;
+  c->is_finished = false;
+  c->wake_state = CORO_WAKE_RUNNABLE;
+  c->switch_count = 0;
+  c->left_timeperiod = coro_clock_from_us(quant_time);
+  c->full_timeperiod = c->left_timeperiod;
+  c->total_time_working = 0;
+  c->id = __atomic_add_fetch(&coro_last_id, 1, __ATOMIC_RELAXED);
+  memset(c->trace_time, 0, sizeof(c->trace_time));
+  if (coro_trace_is_on) {
+    c->trace_state = CORO_TRACE_READY;
+    c->trace_since = coro_clock_now();
+    coro_trace_record(c->id, CORO_TRACE_READY, coro_trace_thread(),
+                      c->trace_since);
+  } else {
+    c->trace_state = -1;
+  }
+  if (c->stack != NULL) {
+    char *stack = (char *)c->stack + coro_stack_guard;
+    coro_ctx_make(c, stack, (char *)c - stack);
+  }
+
+  /*
+   * Now scheduler can work with that coroutine. In M:N mode a
+   * coroutine created by another one stays in the same worker,
+   * others are spread among the workers.
+   */
+  struct coro_worker *w = coro_worker_ptr;
+  if (coro_worker_count == 0) {
+    ++coro_live_count;
+  } else {
+    pthread_mutex_lock(&coro_mt_lock);
+    ++coro_live_count;
+    pthread_mutex_unlock(&coro_mt_lock);
+    if (w == &coro_main) {
+      unsigned i = __atomic_fetch_add(&coro_mt_next_worker, 1,
+                                      __ATOMIC_RELAXED);
+      w = &coro_workers[i % coro_worker_count];
+    }
+  }
+  coro_ready_push(w, c);
   return c;
 }
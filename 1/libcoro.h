@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
@@ -8,20 +9,124 @@ typedef int (*coro_f)(void *);
 /** Make current context scheduler. */
 void coro_sched_init(void);
 
+/**
+ * Switch to M:N mode: coroutines are run by @a count worker
+ * threads, each with its own scheduler. Idle workers steal ready
+ * coroutines from busy ones, so a coroutine can continue in a
+ * different thread after a yield. The calling thread only waits in
+ * coro_sched_wait(). Must be called after coro_sched_init() and
+ * before any coroutine is created. Not supported by the sigjmp
+ * context switch.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int coro_sched_start_workers(int count);
+
+/**
+ * Enable preemption by timer. Each thread running coroutines gets
+ * a timer, raising SIGALRM every @a tick_us microseconds. When the
+ * current coroutine's quantum is over, a flag is set, and the next
+ * yield_if_period_end() yields. The check costs one load instead
+ * of a clock_gettime(). The coroutines still switch only in
+ * yield_if_period_end() and coro_yield(), never in the signal
+ * handler. Must be called before coro_sched_start_workers().
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int coro_sched_start_preempt(long long tick_us);
+
+/**
+ * Stop the worker threads, if any, and free the resources cached
+ * by the scheduler, such as stacks.
+ */
+void coro_sched_destroy(void);
+
+/**
+ * Set the stack size of new coroutines, 1MB by default. Stacks
+ * are mmap-ed and recycled after coro_delete(), so the size can't
+ * be changed per coroutine - cached stacks are freed here.
+ */
+void coro_sched_set_stack_size(size_t size);
+
+/**
+ * Enable or disable PROT_NONE guard pages below the coroutine
+ * stacks. Enabled by default, a stack overflow then crashes with
+ * SIGSEGV instead of corrupting memory. Each guard costs a
+ * separate memory mapping.
+ */
+void coro_sched_set_stack_guard(bool enable);
+
+/**
+ * Enable or disable the shared stack mode, for massive coroutine
+ * counts. All the coroutines run on one stack of the configured
+ * stack size. When a coroutine is switched out for another one, the
+ * used part of the stack is copied into its own heap buffer, and is
+ * copied back when it is resumed. So a coroutine costs as much
+ * memory as deep its stack actually is, at the price of a copy on
+ * each switch between different coroutines.
+ *
+ * Addresses of a switched out coroutine's stack are not valid.
+ * coro_sync.h and coro_io.h keep their state of a waiting coroutine
+ * in its wait slot, so they work in this mode. But the memory they
+ * are given by pointer and access while the caller waits - the
+ * buffers and paths of coro_read(), coro_write(), coro_open() - must
+ * not be on the stack.
+ *
+ * Must be called with no coroutines alive. Not supported in M:N
+ * mode and by the sigjmp context switch.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int coro_sched_set_shared_stack(bool enable);
+
+struct coro_stack_stat {
+  /** Stacks mapped in total, both used and cached. */
+  size_t mapped_count;
+  /** Stacks of deleted coroutines, waiting for reuse. */
+  size_t cached_count;
+  /** Bytes of virtual memory mapped for the stacks. */
+  size_t mapped_size;
+  /** Bytes of the stack save buffers in the shared stack mode. */
+  size_t saved_size;
+  /** Resident set size of the whole process in bytes. */
+  size_t rss;
+};
+
+/** Collect the stack memory statistics. */
+void coro_stack_stat(struct coro_stack_stat *stat);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * if no coroutines, or they all are suspended and nobody can
+ * wake them up. In M:N mode the coroutines are finished by the
+ * workers, and the caller sleeps until one of them is done.
  */
 struct coro *
 coro_sched_wait(void);
 
-/** Currently working coroutine. */
+/** Bytes in the wait slot of a coroutine. */
+enum { CORO_WAIT_SLOT_SIZE = 96 };
+
+/**
+ * Memory of the coroutine for a record of what it waits for, like a
+ * wait queue entry or an I/O request, accessed by others while it is
+ * suspended. Unlike the stack, it stays valid in the shared stack
+ * mode. A coroutine waits for one thing at a time, and the slot is
+ * free again when the wait is over. Aligned as malloc() memory.
+ */
+void *
+coro_wait_slot(struct coro *c);
+
+/** Currently working coroutine of this thread. */
 struct coro *
 coro_this(void);
 
+/** True, if called from a scheduler, not from a coroutine. */
+bool coro_is_sched(void);
+
 /**
  * Create a new coroutine. It is not started, just added to the
- * scheduler.
+ * scheduler. Returns NULL if a stack can't be allocated.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg, int quant_time);
@@ -35,12 +140,67 @@ coro_switch_count(const struct coro *c);
 /** Check if the coroutine has finished. */
 bool coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/** Where the coroutine's time went, see coro_trace.h. */
+struct coro_time_stat {
+  /** On a CPU. */
+  long long cpu_us;
+  /** Ready, but waiting for a CPU. */
+  long long ready_us;
+  /** Suspended. */
+  long long blocked_us;
+};
+
+/**
+ * Get the coroutine's time by states. Only the time while the trace
+ * was on is counted.
+ */
+void coro_time_stat(struct coro *c, struct coro_time_stat *stat);
+
+/** Return the coroutine and its stack to the stack pool. */
 void coro_delete(struct coro *c);
 
 /** Switch to another not finished coroutine. */
 void coro_yield(void);
 
+/**
+ * Suspend the current coroutine until coro_wakeup(). It is taken
+ * off the scheduler and costs nothing while waiting. A wakeup sent
+ * before the suspension is not lost - then the coroutine returns
+ * right away. Wakeups can be spurious, so the caller should check
+ * its wait condition in a loop.
+ */
+void coro_suspend(void);
+
+/**
+ * Make a suspended coroutine ready again. Must be called from a
+ * thread running coroutines - a coroutine or a scheduler.
+ */
+void coro_wakeup(struct coro *c);
+
+/**
+ * Poller of external events, such as I/O completions. Wakes up
+ * the coroutines waiting for them.
+ * @param timeout_ms 0 - don't block, -1 - block until an event,
+ *        otherwise the max time to block.
+ * @retval -1 Nothing to wait for, no events in flight.
+ * @retval >= 0 Number of woken coroutines.
+ */
+typedef int (*coro_poll_f)(void *arg, int timeout_ms);
+
+/**
+ * Set the poller of the current thread's scheduler. It is called
+ * on each yield without blocking, and with blocking when all the
+ * coroutines of the thread are suspended. @a destroy is called
+ * when the scheduler of the thread is stopped. NULL @a poll
+ * removes the poller.
+ */
+void coro_sched_set_poller(coro_poll_f poll, void (*destroy)(void *arg),
+                           void *arg);
+
+/**
+ * Yield, if the current coroutine's time quantum is over. The
+ * quantum is given in coro_new() in microseconds.
+ */
 void yield_if_period_end();
 
 long long
@@ -1,10 +1,13 @@
 #include "mergesort.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "libcoro.h"
+#include "mergesort_simd.h"
 
 void my_memcpy(void *_dst, void *_src, size_t n) {
   char *dst = (char *)_dst;
@@ -46,39 +49,254 @@ void merge(
   }
 }
 
-int mergesort(
-    void *array,
-    size_t elements,
+int loser_tree_create(struct loser_tree *tree, size_t count) {
+  tree->nodes = malloc(count * 3 * sizeof(*tree->nodes));
+  tree->count = count;
+  tree->winner = 0;
+  return tree->nodes == NULL ? -1 : 0;
+}
+
+void loser_tree_destroy(struct loser_tree *tree) {
+  free(tree->nodes);
+  tree->nodes = NULL;
+}
+
+/** A sorted run being consumed by merge_k(). */
+struct merge_run {
+  char *pos;
+  char *end;
+};
+
+/** The runs of merge_k() and how to compare them. */
+struct merge_runs {
+  const struct merge_run *runs;
+  int (*comparator)(const void *, const void *);
+};
+
+/** loser_tree_before_f of merge_k(). */
+static inline bool
+merge_run_before(const void *ctx, size_t a, size_t b) {
+  const struct merge_runs *m = ctx;
+  const struct merge_run *runs = m->runs;
+  if (runs[a].pos == runs[a].end)
+    return false;
+  if (runs[b].pos == runs[b].end)
+    return true;
+  int rc = m->comparator(runs[a].pos, runs[b].pos);
+  return rc < 0 || (rc == 0 && a < b);
+}
+
+int merge_k(
+    void *const *runs, const size_t *run_sizes, size_t run_count,
     size_t element_size,
-    int (*comparator)(const void *, const void *)) {
-  if (elements <= 1) {
+    int (*comparator)(const void *, const void *),
+    void *result) {
+  if (run_count == 0)
     return 0;
+  struct loser_tree tree;
+  struct merge_run *state = malloc(run_count * sizeof(*state));
+  if (loser_tree_create(&tree, run_count) != 0 || state == NULL) {
+    loser_tree_destroy(&tree);
+    free(state);
+    return -1;
   }
+  size_t total = 0;
+  for (size_t i = 0; i < run_count; ++i) {
+    state[i].pos = runs[i];
+    state[i].end = (char *)runs[i] + run_sizes[i] * element_size;
+    total += run_sizes[i];
+  }
+  struct merge_runs ctx = {state, comparator};
+  loser_tree_build(&tree, merge_run_before, &ctx);
+  size_t winner = tree.winner;
 
-  size_t middle = elements / 2;
-  void *left = array;
-  void *right = (char *)array + middle * element_size;
-
-  int mergesort_res;
-  mergesort_res = mergesort(left, middle, element_size, comparator);
-  if (mergesort_res == -1) {
-    return -1;
+  char *out = result;
+  for (size_t i = 0; i < total; ++i) {
+    memcpy(out, state[winner].pos, element_size);
+    out += element_size;
+    state[winner].pos += element_size;
+    winner = loser_tree_replay(&tree, merge_run_before, &ctx);
   }
-  yield_if_period_end();
+  loser_tree_destroy(&tree);
+  free(state);
+  return 0;
+}
 
-  mergesort(right, elements - middle, element_size, comparator);
-  if (mergesort_res == -1) {
-    return -1;
+int mergesort_int_comparator(const void *a, const void *b) {
+  int l = *(const int *)a;
+  int r = *(const int *)b;
+  return (l > r) - (l < r);
+}
+
+int mergesort_int64_comparator(const void *a, const void *b) {
+  int64_t l = *(const int64_t *)a;
+  int64_t r = *(const int64_t *)b;
+  return (l > r) - (l < r);
+}
+
+/** Runs of that many elements are sorted by insertion first. */
+enum { MERGESORT_RUN_SIZE = 16 };
+/** Merged elements between the quantum checks. */
+enum { MERGESORT_YIELD_STEP = 16 * 1024 };
+
+static inline size_t
+mergesort_min(size_t a, size_t b) {
+  return a < b ? a : b;
+}
+
+#define MERGESORT_LESS_NATIVE(a, b, comparator) ((a) < (b))
+#define MERGESORT_LESS_CALL(a, b, comparator) (comparator(&(a), &(b)) < 0)
+
+/**
+ * Bottom-up mergesort of a fixed-size type: insertion-sorted runs,
+ * then passes merging run pairs back and forth between the array
+ * and the scratch buffer. With a native comparison the comparator
+ * is not called at all.
+ */
+#define MERGESORT_DEFINE(name, type, is_less)                              \
+static void                                                                \
+name##_insertion_sort(type *a, size_t n,                                   \
+                      int (*comparator)(const void *, const void *)) {     \
+  (void)comparator;                                                        \
+  for (size_t i = 1; i < n; ++i) {                                         \
+    type v = a[i];                                                         \
+    size_t j = i;                                                          \
+    for (; j > 0 && is_less(v, a[j - 1], comparator); --j)                 \
+      a[j] = a[j - 1];                                                     \
+    a[j] = v;                                                              \
+  }                                                                        \
+}                                                                          \
+                                                                           \
+static void                                                                \
+name##_merge(const type *l, const type *l_end,                             \
+             const type *r, const type *r_end, type *out,                  \
+             int (*comparator)(const void *, const void *)) {              \
+  (void)comparator;                                                        \
+  while (l < l_end && r < r_end) {                                         \
+    if (is_less(*r, *l, comparator))                                       \
+      *out++ = *r++;                                                       \
+    else                                                                   \
+      *out++ = *l++;                                                       \
+  }                                                                        \
+  while (l < l_end)                                                        \
+    *out++ = *l++;                                                         \
+  while (r < r_end)                                                        \
+    *out++ = *r++;                                                         \
+}                                                                          \
+                                                                           \
+static void                                                                \
+name##_sort(type *array, type *scratch, size_t n,                          \
+            int (*comparator)(const void *, const void *)) {               \
+  for (size_t i = 0; i < n; i += MERGESORT_RUN_SIZE) {                     \
+    name##_insertion_sort(array + i,                                       \
+                          mergesort_min(MERGESORT_RUN_SIZE, n - i),        \
+                          comparator);                                     \
+  }                                                                        \
+  type *src = array;                                                       \
+  type *dst = scratch;                                                     \
+  size_t work = 0;                                                         \
+  for (size_t width = MERGESORT_RUN_SIZE; width < n; width *= 2) {         \
+    for (size_t lo = 0; lo < n; lo += 2 * width) {                         \
+      size_t mid = mergesort_min(lo + width, n);                           \
+      size_t hi = mergesort_min(lo + 2 * width, n);                        \
+      name##_merge(src + lo, src + mid, src + mid, src + hi, dst + lo,     \
+                   comparator);                                            \
+      work += hi - lo;                                                     \
+      if (work >= MERGESORT_YIELD_STEP) {                                  \
+        work = 0;                                                          \
+        yield_if_period_end();                                             \
+      }                                                                    \
+    }                                                                      \
+    type *tmp = src;                                                       \
+    src = dst;                                                             \
+    dst = tmp;                                                             \
+  }                                                                        \
+  if (src != array)                                                        \
+    memcpy(array, src, n * sizeof(type));                                  \
+}
+
+MERGESORT_DEFINE(mergesort_int, int, MERGESORT_LESS_NATIVE)
+MERGESORT_DEFINE(mergesort_int64, int64_t, MERGESORT_LESS_NATIVE)
+MERGESORT_DEFINE(mergesort_4, uint32_t, MERGESORT_LESS_CALL)
+MERGESORT_DEFINE(mergesort_8, uint64_t, MERGESORT_LESS_CALL)
+
+/** The same bottom-up sort for elements of any size. */
+static void
+mergesort_generic(char *array, char *scratch, size_t n, size_t element_size,
+                  int (*comparator)(const void *, const void *)) {
+  for (size_t i = 0; i < n; i += MERGESORT_RUN_SIZE) {
+    char *run = array + i * element_size;
+    size_t run_size = mergesort_min(MERGESORT_RUN_SIZE, n - i);
+    for (size_t j = 1; j < run_size; ++j) {
+      /* The scratch is free yet, keep the inserted element there. */
+      memcpy(scratch, run + j * element_size, element_size);
+      size_t k = j;
+      for (; k > 0 && comparator(scratch, run + (k - 1) * element_size) < 0;
+           --k)
+        ;
+      memmove(run + (k + 1) * element_size, run + k * element_size,
+              (j - k) * element_size);
+      memcpy(run + k * element_size, scratch, element_size);
+    }
   }
-  yield_if_period_end();
+  char *src = array;
+  char *dst = scratch;
+  size_t work = 0;
+  for (size_t width = MERGESORT_RUN_SIZE; width < n; width *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = mergesort_min(lo + width, n);
+      size_t hi = mergesort_min(lo + 2 * width, n);
+      char *l = src + lo * element_size;
+      char *l_end = src + mid * element_size;
+      char *r = l_end;
+      char *r_end = src + hi * element_size;
+      char *out = dst + lo * element_size;
+      while (l < l_end && r < r_end) {
+        char **from = comparator(r, l) < 0 ? &r : &l;
+        memcpy(out, *from, element_size);
+        *from += element_size;
+        out += element_size;
+      }
+      memcpy(out, l, l_end - l);
+      out += l_end - l;
+      memcpy(out, r, r_end - r);
+      work += hi - lo;
+      if (work >= MERGESORT_YIELD_STEP) {
+        work = 0;
+        yield_if_period_end();
+      }
+    }
+    char *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  if (src != array)
+    memcpy(array, src, n * element_size);
+}
 
-  void *temp = malloc(elements * element_size);
-  if (!temp) {
+int mergesort(
+    void *array,
+    size_t elements,
+    size_t element_size,
+    int (*comparator)(const void *, const void *)) {
+  if (elements <= 1) {
+    return 0;
+  }
+  void *scratch = malloc(elements * element_size);
+  if (!scratch) {
     return -1;
   }
-  merge(left, right, middle, elements - middle, element_size, comparator, temp);
-  my_memcpy(array, temp, elements * element_size);
-  free(temp);
-
+  if (element_size == sizeof(int) && comparator == mergesort_int_comparator) {
+    if (mergesort_simd_int(array, scratch, elements) != 0)
+      mergesort_int_sort(array, scratch, elements, comparator);
+  } else if (element_size == 8 && comparator == mergesort_int64_comparator)
+    mergesort_int64_sort(array, scratch, elements, comparator);
+  else if (element_size == 4)
+    mergesort_4_sort(array, scratch, elements, comparator);
+  else if (element_size == 8)
+    mergesort_8_sort(array, scratch, elements, comparator);
+  else
+    mergesort_generic(array, scratch, elements, element_size, comparator);
+  free(scratch);
   return 0;
 }
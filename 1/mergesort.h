@@ -1,11 +1,50 @@
 #pragma once
+#include <stdbool.h>
 #include <stddef.h>
 
+/**
+ * Stable sort with one scratch buffer, no other allocations.
+ * Elements of 4 and 8 bytes are moved as integers. With the
+ * comparators below the comparison is inlined too, and ints are
+ * sorted with SIMD when the CPU has it.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
 int mergesort(
     void *array,
     size_t elements, size_t element_size,
     int (*comparator)(const void *, const void *));
 
+/** Vector instructions mergesort() can use for int keys. */
+enum mergesort_simd {
+  MERGESORT_SIMD_NONE,
+  MERGESORT_SIMD_SSE41,
+  MERGESORT_SIMD_AVX2,
+};
+
+/**
+ * Limit the vector instructions used for sorting ints with
+ * mergesort_int_comparator. By default the best ones supported by
+ * the CPU are used. Returns the level actually in effect.
+ */
+enum mergesort_simd
+mergesort_set_simd(enum mergesort_simd max);
+
+/** Ascending order of int. Lets mergesort() compare inline. */
+int mergesort_int_comparator(const void *a, const void *b);
+
+/** Ascending order of int64_t. Lets mergesort() compare inline. */
+int mergesort_int64_comparator(const void *a, const void *b);
+
+/**
+ * Merge 2 sorted int arrays ascending, with SIMD when the CPU has
+ * it. Equal elements go from @a left first.
+ */
+void merge_int(
+    const int *left, size_t left_size,
+    const int *right, size_t right_size,
+    int *result);
+
 void my_memcpy(void *_dst, void *_src, size_t n);
 
 void merge(
@@ -14,3 +53,95 @@ void merge(
     size_t element_size,
     int (*comparator)(const void *, const void *),
     void *result);
+
+/**
+ * Merge @a run_count sorted runs into @a result in one pass, using
+ * a loser tree: O(N log K) comparisons. The comparator contract is
+ * the same as in merge(), equal elements are taken from the runs in
+ * their order, so the merge is stable.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int merge_k(
+    void *const *runs, const size_t *run_sizes, size_t run_count,
+    size_t element_size,
+    int (*comparator)(const void *, const void *),
+    void *result);
+
+/**
+ * True, if the head of the source @a a of a k-way merge goes before
+ * the head of @a b. Exhausted sources must go last, and ties to the
+ * lower index, then the merge is stable.
+ */
+typedef bool (*loser_tree_before_f)(const void *ctx, size_t a, size_t b);
+
+/**
+ * Loser tree of a k-way merge, used by merge_k() and the merges of
+ * the sorted runs streamed from files and channels. The sources are
+ * the leaves K..2K-1 of an implicit tree, node i has the parent i / 2.
+ * Each inner node keeps the loser of the match played in it, so
+ * replacing the winner only replays the path from its leaf to the
+ * root: O(log K) comparisons. The tree knows only the source indexes,
+ * the sources are compared by the caller's callback. The functions
+ * are inline, so is the callback.
+ */
+struct loser_tree {
+  /** Losers use the nodes 1..K-1, winners - 1..2K-1 while building. */
+  size_t *nodes;
+  size_t count;
+  /** The source with the smallest head. */
+  size_t winner;
+};
+
+/**
+ * @param count Number of the sources, > 0.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int loser_tree_create(struct loser_tree *tree, size_t count);
+
+/** Free the nodes. Can be called after a failed create too. */
+void loser_tree_destroy(struct loser_tree *tree);
+
+/** Play all the matches. Heads of all the sources must be ready. */
+static inline void
+loser_tree_build(struct loser_tree *tree, loser_tree_before_f before,
+                 const void *ctx) {
+  size_t k = tree->count;
+  size_t *losers = tree->nodes;
+  size_t *winners = tree->nodes + k;
+  for (size_t i = 0; i < k; ++i)
+    winners[k + i] = i;
+  for (size_t node = k - 1; node >= 1; --node) {
+    size_t l = winners[2 * node];
+    size_t r = winners[2 * node + 1];
+    if (before(ctx, l, r)) {
+      winners[node] = l;
+      losers[node] = r;
+    } else {
+      winners[node] = r;
+      losers[node] = l;
+    }
+  }
+  tree->winner = k > 1 ? winners[1] : 0;
+}
+
+/**
+ * Find the new winner after the head of the current one has changed
+ * - it is consumed, or its source is refilled or exhausted.
+ */
+static inline size_t
+loser_tree_replay(struct loser_tree *tree, loser_tree_before_f before,
+                  const void *ctx) {
+  size_t *losers = tree->nodes;
+  size_t winner = tree->winner;
+  for (size_t node = (winner + tree->count) / 2; node >= 1; node /= 2) {
+    if (before(ctx, losers[node], winner)) {
+      size_t tmp = losers[node];
+      losers[node] = winner;
+      winner = tmp;
+    }
+  }
+  tree->winner = winner;
+  return winner;
+}
@@ -0,0 +1,349 @@
+#include "mergesort_simd.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "libcoro.h"
+#include "mergesort.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MERGESORT_SIMD_X86 1
+#endif
+
+/**
+ * The array is cut into blocks of a vector width, each block is
+ * sorted inside a register by a bitonic network. Then the blocks are
+ * merged bottom-up. Two sorted vectors are merged by a bitonic merge
+ * network, giving the lower and the upper halves. The lower one is
+ * stored, the upper one is merged with the next vector from the run
+ * with the smaller head. No branches depend on the compared values
+ * except the choice of the next vector.
+ */
+
+/** Elements merged between the quantum checks. */
+enum { MERGESORT_SIMD_YIELD_STEP = 64 * 1024 };
+
+/** -1, if not detected yet. */
+static int mergesort_simd_supported = -1;
+static enum mergesort_simd mergesort_simd_limit = MERGESORT_SIMD_AVX2;
+
+static enum mergesort_simd
+mergesort_simd_detect(void) {
+  if (mergesort_simd_supported < 0) {
+    int level = MERGESORT_SIMD_NONE;
+#ifdef MERGESORT_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      level = MERGESORT_SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse4.1"))
+      level = MERGESORT_SIMD_SSE41;
+#endif
+    mergesort_simd_supported = level;
+  }
+  return mergesort_simd_supported;
+}
+
+enum mergesort_simd
+mergesort_set_simd(enum mergesort_simd max) {
+  mergesort_simd_limit = max;
+  enum mergesort_simd level = mergesort_simd_detect();
+  return level < max ? level : max;
+}
+
+#ifdef MERGESORT_SIMD_X86
+
+static inline void
+mergesort_simd_insertion_sort(int *a, size_t n) {
+  for (size_t i = 1; i < n; ++i) {
+    int v = a[i];
+    size_t j = i;
+    for (; j > 0 && v < a[j - 1]; --j)
+      a[j] = a[j - 1];
+    a[j] = v;
+  }
+}
+
+static inline int *
+mergesort_simd_merge_scalar(const int *a, const int *a_end, const int *b,
+                            const int *b_end, int *out) {
+  while (a < a_end && b < b_end)
+    *out++ = *b < *a ? *b++ : *a++;
+  memcpy(out, a, (a_end - a) * sizeof(*a));
+  out += a_end - a;
+  memcpy(out, b, (b_end - b) * sizeof(*b));
+  return out + (b_end - b);
+}
+
+/**
+ * Finish a vector merge: the upper half left in the register went
+ * to @a h, it is merged with the rest of both runs.
+ */
+static void
+mergesort_simd_merge_tail(const int *h, const int *h_end, const int *a,
+                          const int *a_end, const int *b, const int *b_end,
+                          int *out) {
+  while (h < h_end) {
+    if (a < a_end && *a <= *h && (b == b_end || *a <= *b))
+      *out++ = *a++;
+    else if (b < b_end && *b < *h)
+      *out++ = *b++;
+    else
+      *out++ = *h++;
+  }
+  mergesort_simd_merge_scalar(a, a_end, b, b_end, out);
+}
+
+/**
+ * Compare-exchange of each lane with the lane given by @a perm. The
+ * lanes set in @a mask get the max.
+ */
+#define MERGESORT_AVX2_CMPX(v, perm, mask) do {                            \
+  __m256i p_ = (perm);                                                     \
+  (v) = _mm256_blend_epi32(_mm256_min_epi32((v), p_),                      \
+                           _mm256_max_epi32((v), p_), (mask));             \
+} while (0)
+
+#define MERGESORT_AVX2_SWAP_1(v) _mm256_shuffle_epi32((v), 0xb1)
+#define MERGESORT_AVX2_SWAP_2(v) _mm256_shuffle_epi32((v), 0x4e)
+#define MERGESORT_AVX2_SWAP_4(v) _mm256_permute2x128_si256((v), (v), 1)
+
+__attribute__((target("avx2")))
+static inline __m256i
+mergesort_avx2_sort8(__m256i v) {
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_1(v), 0x66);
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_2(v), 0x3c);
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_1(v), 0x5a);
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_4(v), 0xf0);
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_2(v), 0xcc);
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_1(v), 0xaa);
+  return v;
+}
+
+/** Sort a bitonic vector ascending. */
+__attribute__((target("avx2")))
+static inline __m256i
+mergesort_avx2_clean8(__m256i v) {
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_4(v), 0xf0);
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_2(v), 0xcc);
+  MERGESORT_AVX2_CMPX(v, MERGESORT_AVX2_SWAP_1(v), 0xaa);
+  return v;
+}
+
+/** Merge 2 sorted vectors into the lower and the upper sorted halves. */
+__attribute__((target("avx2")))
+static inline void
+mergesort_avx2_merge8(__m256i *lo, __m256i *hi) {
+  __m256i rev = _mm256_permutevar8x32_epi32(
+    *hi, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+  __m256i l = _mm256_min_epi32(*lo, rev);
+  __m256i h = _mm256_max_epi32(*lo, rev);
+  *lo = mergesort_avx2_clean8(l);
+  *hi = mergesort_avx2_clean8(h);
+}
+
+__attribute__((target("avx2")))
+static void
+mergesort_avx2_sort_blocks(int *a, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+    _mm256_storeu_si256((__m256i *)(a + i), mergesort_avx2_sort8(v));
+  }
+  mergesort_simd_insertion_sort(a + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+mergesort_avx2_merge(const int *a, const int *a_end, const int *b,
+                     const int *b_end, int *out) {
+  if (a_end - a < 8 || b_end - b < 8) {
+    mergesort_simd_merge_scalar(a, a_end, b, b_end, out);
+    return;
+  }
+  __m256i lo = _mm256_loadu_si256((const __m256i *)a);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)b);
+  a += 8;
+  b += 8;
+  while (true) {
+    mergesort_avx2_merge8(&lo, &hi);
+    _mm256_storeu_si256((__m256i *)out, lo);
+    out += 8;
+    const int **next;
+    const int *next_end;
+    if (a < a_end && (b == b_end || *a <= *b)) {
+      next = &a;
+      next_end = a_end;
+    } else {
+      next = &b;
+      next_end = b_end;
+    }
+    if (next_end - *next < 8)
+      break;
+    lo = _mm256_loadu_si256((const __m256i *)*next);
+    *next += 8;
+  }
+  int h[8];
+  _mm256_storeu_si256((__m256i *)h, hi);
+  mergesort_simd_merge_tail(h, h + 8, a, a_end, b, b_end, out);
+}
+
+#define MERGESORT_SSE41_CMPX(v, perm, mask) do {                           \
+  __m128i p_ = (perm);                                                     \
+  (v) = _mm_blend_epi16(_mm_min_epi32((v), p_), _mm_max_epi32((v), p_),    \
+                        (mask));                                           \
+} while (0)
+
+#define MERGESORT_SSE41_SWAP_1(v) _mm_shuffle_epi32((v), 0xb1)
+#define MERGESORT_SSE41_SWAP_2(v) _mm_shuffle_epi32((v), 0x4e)
+
+/* The blend masks are per 16-bit lane, 2 bits per int. */
+__attribute__((target("sse4.1")))
+static inline __m128i
+mergesort_sse41_sort4(__m128i v) {
+  MERGESORT_SSE41_CMPX(v, MERGESORT_SSE41_SWAP_1(v), 0x3c);
+  MERGESORT_SSE41_CMPX(v, MERGESORT_SSE41_SWAP_2(v), 0xf0);
+  MERGESORT_SSE41_CMPX(v, MERGESORT_SSE41_SWAP_1(v), 0xcc);
+  return v;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+mergesort_sse41_clean4(__m128i v) {
+  MERGESORT_SSE41_CMPX(v, MERGESORT_SSE41_SWAP_2(v), 0xf0);
+  MERGESORT_SSE41_CMPX(v, MERGESORT_SSE41_SWAP_1(v), 0xcc);
+  return v;
+}
+
+__attribute__((target("sse4.1")))
+static inline void
+mergesort_sse41_merge4(__m128i *lo, __m128i *hi) {
+  __m128i rev = _mm_shuffle_epi32(*hi, 0x1b);
+  __m128i l = _mm_min_epi32(*lo, rev);
+  __m128i h = _mm_max_epi32(*lo, rev);
+  *lo = mergesort_sse41_clean4(l);
+  *hi = mergesort_sse41_clean4(h);
+}
+
+__attribute__((target("sse4.1")))
+static void
+mergesort_sse41_sort_blocks(int *a, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+    _mm_storeu_si128((__m128i *)(a + i), mergesort_sse41_sort4(v));
+  }
+  mergesort_simd_insertion_sort(a + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void
+mergesort_sse41_merge(const int *a, const int *a_end, const int *b,
+                      const int *b_end, int *out) {
+  if (a_end - a < 4 || b_end - b < 4) {
+    mergesort_simd_merge_scalar(a, a_end, b, b_end, out);
+    return;
+  }
+  __m128i lo = _mm_loadu_si128((const __m128i *)a);
+  __m128i hi = _mm_loadu_si128((const __m128i *)b);
+  a += 4;
+  b += 4;
+  while (true) {
+    mergesort_sse41_merge4(&lo, &hi);
+    _mm_storeu_si128((__m128i *)out, lo);
+    out += 4;
+    const int **next;
+    const int *next_end;
+    if (a < a_end && (b == b_end || *a <= *b)) {
+      next = &a;
+      next_end = a_end;
+    } else {
+      next = &b;
+      next_end = b_end;
+    }
+    if (next_end - *next < 4)
+      break;
+    lo = _mm_loadu_si128((const __m128i *)*next);
+    *next += 4;
+  }
+  int h[4];
+  _mm_storeu_si128((__m128i *)h, hi);
+  mergesort_simd_merge_tail(h, h + 4, a, a_end, b, b_end, out);
+}
+
+#endif /* MERGESORT_SIMD_X86 */
+
+/** The level allowed to be used now. */
+static enum mergesort_simd
+mergesort_simd_level(void) {
+  enum mergesort_simd level = mergesort_simd_detect();
+  return level < mergesort_simd_limit ? level : mergesort_simd_limit;
+}
+
+void merge_int(const int *left, size_t left_size, const int *right,
+               size_t right_size, int *result) {
+  const int *left_end = left + left_size;
+  const int *right_end = right + right_size;
+  switch (mergesort_simd_level()) {
+#ifdef MERGESORT_SIMD_X86
+  case MERGESORT_SIMD_AVX2:
+    mergesort_avx2_merge(left, left_end, right, right_end, result);
+    return;
+  case MERGESORT_SIMD_SSE41:
+    mergesort_sse41_merge(left, left_end, right, right_end, result);
+    return;
+#endif
+  default:
+    break;
+  }
+  while (left < left_end && right < right_end)
+    *result++ = *right < *left ? *right++ : *left++;
+  memcpy(result, left, (left_end - left) * sizeof(*left));
+  result += left_end - left;
+  memcpy(result, right, (right_end - right) * sizeof(*right));
+}
+
+int mergesort_simd_int(int *array, int *scratch, size_t n) {
+  enum mergesort_simd level = mergesort_simd_level();
+  void (*sort_blocks)(int *, size_t);
+  void (*merge)(const int *, const int *, const int *, const int *, int *);
+  size_t width;
+  switch (level) {
+#ifdef MERGESORT_SIMD_X86
+  case MERGESORT_SIMD_AVX2:
+    sort_blocks = mergesort_avx2_sort_blocks;
+    merge = mergesort_avx2_merge;
+    width = 8;
+    break;
+  case MERGESORT_SIMD_SSE41:
+    sort_blocks = mergesort_sse41_sort_blocks;
+    merge = mergesort_sse41_merge;
+    width = 4;
+    break;
+#endif
+  default:
+    return -1;
+  }
+  sort_blocks(array, n);
+  int *src = array;
+  int *dst = scratch;
+  size_t work = 0;
+  for (; width < n; width *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = lo + width < n ? lo + width : n;
+      size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+      merge(src + lo, src + mid, src + mid, src + hi, dst + lo);
+      work += hi - lo;
+      if (work >= MERGESORT_SIMD_YIELD_STEP) {
+        work = 0;
+        yield_if_period_end();
+      }
+    }
+    int *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  if (src != array)
+    memcpy(array, src, n * sizeof(*array));
+  return 0;
+}
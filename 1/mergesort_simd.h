@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Vectorized sort of int keys, the backend of mergesort() with
+ * mergesort_int_comparator. Not a public API.
+ */
+
+/**
+ * Sort ascending using the scratch buffer of the same size.
+ * @retval 0 Sorted.
+ * @retval -1 SIMD is not available or is disabled, nothing done.
+ */
+int mergesort_simd_int(int *array, int *scratch, size_t n);
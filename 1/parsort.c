@@ -0,0 +1,194 @@
+#include "parsort.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coro_sync.h"
+#include "libcoro.h"
+#include "mergesort.h"
+#include "radixsort.h"
+
+/** Child coroutines of one parsort_int() call and their join. */
+struct parsort_group {
+  struct coro_spinlock lock;
+  /** Children not finished yet. */
+  size_t active;
+  /** The parent, waiting for the children. */
+  struct coro_wait_queue waiters;
+  int rc;
+};
+
+/** A sort of one chunk or a merge of one merge path segment. */
+struct parsort_task {
+  struct parsort_group *group;
+  /** The chunk to sort, or the left part to merge. */
+  int *left;
+  size_t left_size;
+  /** The right part to merge. NULL for a sort. */
+  const int *right;
+  size_t right_size;
+  int *result;
+};
+
+static int
+parsort_task_f(void *arg) {
+  struct parsort_task *t = arg;
+  int rc = 0;
+  if (t->right == NULL) {
+    if (t->left_size >= RADIXSORT_MIN_SIZE)
+      rc = radixsort_int(t->left, t->left_size);
+    else
+      rc = mergesort(t->left, t->left_size, sizeof(int),
+                     mergesort_int_comparator);
+  } else {
+    merge_int(t->left, t->left_size, t->right, t->right_size, t->result);
+  }
+  struct parsort_group *g = t->group;
+  coro_spin_lock(&g->lock);
+  if (rc != 0)
+    g->rc = rc;
+  if (--g->active == 0)
+    coro_wait_queue_wake_all(&g->waiters);
+  coro_spin_unlock(&g->lock);
+  return rc;
+}
+
+static int
+parsort_start(struct parsort_task *t, int quant_time) {
+  struct parsort_group *g = t->group;
+  coro_spin_lock(&g->lock);
+  ++g->active;
+  coro_spin_unlock(&g->lock);
+  if (coro_new(parsort_task_f, t, quant_time) != NULL)
+    return 0;
+  coro_spin_lock(&g->lock);
+  --g->active;
+  g->rc = -1;
+  coro_spin_unlock(&g->lock);
+  return -1;
+}
+
+/** Wait for all the started tasks. */
+static int
+parsort_wait(struct parsort_group *g) {
+  coro_spin_lock(&g->lock);
+  while (g->active > 0)
+    coro_wait_queue_wait(&g->waiters, &g->lock);
+  int rc = g->rc;
+  coro_spin_unlock(&g->lock);
+  return rc;
+}
+
+/**
+ * Merge path: how many elements of @a a go into the first @a diag
+ * elements of the merge of @a a and @a b. Ties go to @a a.
+ */
+static size_t
+parsort_merge_path(const int *a, size_t a_size, const int *b, size_t b_size,
+                   size_t diag) {
+  size_t lo = diag > b_size ? diag - b_size : 0;
+  size_t hi = diag < a_size ? diag : a_size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (a[mid] <= b[diag - mid - 1])
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int parsort_int(int *array, size_t n, size_t chunk_size, int quant_time) {
+  if (chunk_size == 0 || n <= chunk_size) {
+    if (n >= RADIXSORT_MIN_SIZE)
+      return radixsort_int(array, n);
+    return mergesort(array, n, sizeof(int), mergesort_int_comparator);
+  }
+  size_t run_count = (n + chunk_size - 1) / chunk_size;
+  /*
+   * Merges are split into parts of chunk_size, so a round has at most
+   * a task per chunk, +1 for a short last part.
+   */
+  size_t task_capacity = run_count + 1;
+  struct parsort_task *tasks = malloc(task_capacity * sizeof(*tasks));
+  size_t *runs = malloc((run_count + 1) * sizeof(*runs));
+  int *scratch = malloc(n * sizeof(*scratch));
+  if (tasks == NULL || runs == NULL || scratch == NULL) {
+    free(tasks);
+    free(runs);
+    free(scratch);
+    return -1;
+  }
+  struct parsort_group group = {
+    CORO_SPINLOCK_INITIALIZER, 0, CORO_WAIT_QUEUE_INITIALIZER, 0,
+  };
+
+  /* runs[i] is the start of the run i, runs[run_count] = n. */
+  for (size_t i = 0; i < run_count; ++i) {
+    runs[i] = i * chunk_size;
+    struct parsort_task *t = &tasks[i];
+    t->group = &group;
+    t->left = array + runs[i];
+    t->left_size = i + 1 < run_count ? chunk_size : n - runs[i];
+    t->right = NULL;
+    t->right_size = 0;
+    t->result = NULL;
+    if (parsort_start(t, quant_time) != 0)
+      break;
+  }
+  runs[run_count] = n;
+  int rc = parsort_wait(&group);
+
+  int *src = array;
+  int *dst = scratch;
+  while (rc == 0 && run_count > 1) {
+    size_t task_count = 0;
+    size_t new_count = 0;
+    for (size_t r = 0; r < run_count; r += 2) {
+      size_t lo = runs[r];
+      runs[new_count++] = lo;
+      if (r + 1 == run_count) {
+        /* The odd run out is just moved. */
+        memcpy(dst + lo, src + lo, (n - lo) * sizeof(*src));
+        continue;
+      }
+      size_t mid = runs[r + 1];
+      size_t hi = runs[r + 2];
+      const int *a = src + lo;
+      size_t a_size = mid - lo;
+      const int *b = src + mid;
+      size_t b_size = hi - mid;
+      size_t parts = (hi - lo + chunk_size - 1) / chunk_size;
+      size_t a_pos = 0;
+      for (size_t p = 0; p < parts; ++p) {
+        size_t diag = p + 1 == parts ? hi - lo : (p + 1) * chunk_size;
+        size_t a_next = parsort_merge_path(a, a_size, b, b_size, diag);
+        size_t diag_start = p * chunk_size;
+        size_t b_pos = diag_start - a_pos;
+        struct parsort_task *t = &tasks[task_count++];
+        t->group = &group;
+        t->left = (int *)a + a_pos;
+        t->left_size = a_next - a_pos;
+        t->right = b + b_pos;
+        t->right_size = diag - a_next - b_pos;
+        t->result = dst + lo + diag_start;
+        if (parsort_start(t, quant_time) != 0)
+          break;
+        a_pos = a_next;
+      }
+    }
+    runs[new_count] = n;
+    run_count = new_count;
+    rc = parsort_wait(&group);
+    int *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  if (rc == 0 && src != array)
+    memcpy(array, src, n * sizeof(*array));
+  free(tasks);
+  free(runs);
+  free(scratch);
+  return rc;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Sort a big int array by several coroutines. The array is cut into
+ * chunks of @a chunk_size numbers, each one is sorted by a child
+ * coroutine. Then the chunks are merged pairwise in rounds, each
+ * merge being split by merge path into parts of about @a chunk_size,
+ * also merged by child coroutines. With workers the children run on
+ * all the threads. Must be called from a coroutine.
+ * @retval 0 Success.
+ * @retval -1 Out of memory or could not start a coroutine.
+ */
+int parsort_int(int *array, size_t n, size_t chunk_size, int quant_time);
+
+/** Default chunk size, arrays smaller than that are not split. */
+enum { PARSORT_CHUNK_SIZE = 256 * 1024 };
@@ -0,0 +1,80 @@
+#include "radixsort.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcoro.h"
+
+/**
+ * 32 bits are sorted in 3 passes by 11, 11 and 10 bits. The sign bit
+ * is flipped, so the negative numbers go first when the keys are
+ * compared as unsigned. All the histograms are built in one read of
+ * the array, and a pass is skipped when all the keys have the same
+ * digit.
+ */
+enum {
+  RADIXSORT_DIGIT_BITS = 11,
+  RADIXSORT_BUCKET_COUNT = 1 << RADIXSORT_DIGIT_BITS,
+  RADIXSORT_PASS_COUNT = 3,
+};
+
+_Static_assert(RADIXSORT_PASS_COUNT * RADIXSORT_BUCKET_COUNT * sizeof(size_t) ==
+               RADIXSORT_HISTOGRAM_SIZE, "the histogram size is exported");
+
+static inline uint32_t
+radixsort_key(int value) {
+  return (uint32_t)value ^ 0x80000000u;
+}
+
+static inline uint32_t
+radixsort_digit(uint32_t key, int pass) {
+  return (key >> (pass * RADIXSORT_DIGIT_BITS)) & (RADIXSORT_BUCKET_COUNT - 1);
+}
+
+int radixsort_int(int *array, size_t n) {
+  if (n <= 1)
+    return 0;
+  size_t (*counts)[RADIXSORT_BUCKET_COUNT] =
+    calloc(RADIXSORT_PASS_COUNT, sizeof(*counts));
+  int *scratch = malloc(n * sizeof(*scratch));
+  if (counts == NULL || scratch == NULL) {
+    free(counts);
+    free(scratch);
+    return -1;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t key = radixsort_key(array[i]);
+    for (int pass = 0; pass < RADIXSORT_PASS_COUNT; ++pass)
+      ++counts[pass][radixsort_digit(key, pass)];
+  }
+  yield_if_period_end();
+
+  int *src = array;
+  int *dst = scratch;
+  for (int pass = 0; pass < RADIXSORT_PASS_COUNT; ++pass) {
+    size_t *count = counts[pass];
+    if (count[radixsort_digit(radixsort_key(src[0]), pass)] == n)
+      continue;
+    /* Counts become the bucket start offsets. */
+    size_t offset = 0;
+    for (int b = 0; b < RADIXSORT_BUCKET_COUNT; ++b) {
+      size_t bucket_size = count[b];
+      count[b] = offset;
+      offset += bucket_size;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      int value = src[i];
+      dst[count[radixsort_digit(radixsort_key(value), pass)]++] = value;
+    }
+    int *tmp = src;
+    src = dst;
+    dst = tmp;
+    yield_if_period_end();
+  }
+  if (src != array)
+    memcpy(array, src, n * sizeof(*array));
+  free(counts);
+  free(scratch);
+  return 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * LSD radix sort of ints ascending, by 11-bit digits. The quantum is
+ * checked between the passes. Beats mergesort() on big arrays, see
+ * RADIXSORT_MIN_SIZE.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int radixsort_int(int *array, size_t n);
+
+/**
+ * Array size from which radixsort_int() is used instead of
+ * mergesort(), wherever ints are sorted. It is the crossover measured
+ * by bench_sort -n against the AVX2 mergesort(): they are about even
+ * at 2K elements, radix sort is ~15% faster at 2.5K and ~40% at 4K.
+ * The scalar mergesort() loses to radix sort from a few hundred
+ * elements already.
+ */
+enum { RADIXSORT_MIN_SIZE = 2048 };
+
+/**
+ * Memory radixsort_int() takes besides a scratch copy of the array -
+ * the digit histograms, in bytes.
+ */
+enum { RADIXSORT_HISTOGRAM_SIZE = 3 * 2048 * sizeof(size_t) };
@@ -1,88 +1,209 @@
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "coro_io.h"
+#include "coro_trace.h"
+#include "extsort.h"
+#include "intio.h"
 #include "libcoro.h"
 #include "mergesort.h"
+#include "parsort.h"
+#include "sortpipe.h"
 
 struct IntArray {
   int *data;
   int length;
 };
 
+/** Size of the chunks the input files are read and parsed by. */
+enum { READ_CHUNK_SIZE = 256 * 1024 };
+
+/** Total parsed text size and parse time over all the files. */
+static size_t parse_byte_count;
+static long long parse_time_ns;
+
+static long long
+now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Read and parse the file chunk by chunk. The I/O goes through
+ * coro_read(), so the other coroutines keep sorting while this one
+ * waits for the disk. The output is pre-sized from the file size.
+ */
 int read_integers_from_file(const char *filename, struct IntArray *result) {
-  FILE *file = fopen(filename, "r");  // Open the file for reading
-  if (file == NULL) {
+  int fd = coro_open(filename, O_RDONLY, 0);
+  if (fd < 0) {
     perror("Error opening the file");
     return 1;
   }
-
-  int capacity = 10;
-  int size = 0;
-  int *integers = (int *)malloc(capacity * sizeof(int));
-
-  if (integers == NULL) {
-    fclose(file);
+  struct stat st;
+  size_t text_size = 0;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    text_size = st.st_size;
+  struct int_parser parser;
+  char *chunk = malloc(READ_CHUNK_SIZE);
+  if (chunk == NULL || int_parser_create(&parser, text_size) != 0) {
+    free(chunk);
+    close(fd);
     return 1;
   }
-
-  int number;
-  while (fscanf(file, "%d", &number) == 1) {
-    integers[size++] = number;
-
-    if (size >= capacity) {
-      capacity *= 2;
-      int *temp = realloc(integers, capacity * sizeof(int));
-      if (temp == NULL) {
-        free(integers);
-        fclose(file);
-        return 1;
-      }
-      integers = temp;
+  size_t byte_count = 0;
+  long long parse_time = 0;
+  int rc = 1;
+  while (true) {
+    ssize_t len = coro_read(fd, chunk, READ_CHUNK_SIZE);
+    if (len < 0) {
+      perror("Error reading the file");
+      break;
+    }
+    long long start = now_ns();
+    if (len == 0) {
+      rc = int_parser_finish(&parser) == 0 ? 0 : 1;
+      parse_time += now_ns() - start;
+      break;
+    }
+    if (int_parser_feed(&parser, chunk, len) != 0) {
+      printf("Not a number in file %s\n", filename);
+      break;
     }
+    parse_time += now_ns() - start;
+    byte_count += len;
+    yield_if_period_end();
   }
-
-  if (ferror(file) != 0) {
-    fclose(file);
-    free(integers);
+  free(chunk);
+  close(fd);
+  if (rc != 0) {
+    int_parser_destroy(&parser);
     return 1;
   }
+  __atomic_add_fetch(&parse_byte_count, byte_count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&parse_time_ns, parse_time, __ATOMIC_RELAXED);
+
+  result->data = parser.data;
+  result->length = parser.size;
+  return 0;
+}
 
-  result->data = integers;
-  result->length = size;
+/** Text size and time of writing the result. */
+static size_t write_byte_count;
+static long long write_time_ns;
 
-  fclose(file);
+/** Open result.txt and a writer for it. */
+static int
+result_open(struct int_writer *writer) {
+  int fd = open("result.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    printf("Error opening the file");
+    return 1;
+  }
+  if (int_writer_create(writer, fd) != 0) {
+    close(fd);
+    return 1;
+  }
   return 0;
 }
 
+/** Flush and close result.txt, account the write. */
+static int
+result_close(struct int_writer *writer, long long start) {
+  int rc = 0;
+  if (int_writer_flush(writer) != 0) {
+    perror("Error writing the file");
+    rc = 1;
+  }
+  write_byte_count = writer->byte_count;
+  close(writer->fd);
+  int_writer_destroy(writer);
+  write_time_ns = now_ns() - start;
+  return rc;
+}
+
 int write_integers_to_file(int *array, int len) {
-  FILE *file = fopen("result.txt", "w");
-  if (file == NULL) {
-    printf("Error opening the file");
+  long long start = now_ns();
+  struct int_writer writer;
+  if (result_open(&writer) != 0)
     return 1;
+  int rc = 0;
+  if (int_writer_write(&writer, array, len) != 0) {
+    perror("Error writing the file");
+    rc = 1;
   }
+  if (result_close(&writer, start) != 0)
+    rc = 1;
+  return rc;
+}
+
+/** Files with more numbers are sorted by chunks of that size. */
+static size_t split_size = PARSORT_CHUNK_SIZE;
 
-  for (int i = 0; i < len; i++) {
-    fprintf(file, "%d ", array[i]);
+/** External sort of the files, if a memory budget is given. */
+static struct extsort external_sort;
+static bool is_external_sort = false;
+
+/** Merge the spilled runs of all the files into result.txt. */
+static int
+write_external_result(void) {
+  long long start = now_ns();
+  struct int_writer writer;
+  if (result_open(&writer) != 0)
+    return 1;
+  int rc = 0;
+  if (extsort_merge(&external_sort, &writer) != 0) {
+    perror("Error merging the runs");
+    rc = 1;
   }
+  if (result_close(&writer, start) != 0)
+    rc = 1;
+  return rc;
+}
 
-  fclose(file);
+/** Files are sorted by chunks, streamed into the merge when sorted. */
+static struct sortpipe sort_pipe;
+static bool is_streaming = false;
 
-  return 0;
+/**
+ * The merge coroutine of the streaming mode, writes into result.txt
+ * when all the chunks are sorted.
+ */
+static int
+stream_merge_f(void *arg) {
+  struct int_writer *writer = arg;
+  /* The files report their own errors. */
+  int rc = sortpipe_wait(&sort_pipe) == 0 ? 0 : 1;
+  long long start = now_ns();
+  if (rc == 0 && sortpipe_merge(&sort_pipe, writer) != 0) {
+    perror("Error merging the files");
+    rc = 1;
+  }
+  if (result_close(writer, start) != 0)
+    rc = 1;
+  return rc;
 }
 
 struct my_context {
   char *filename;
   struct IntArray *array;
   /** ADD HERE YOUR OWN MEMBERS, SUCH AS FILE NAME, WORK TIME, ... */
+  /** Quantum of the coroutine, given to its children too. */
+  int quant_time;
 };
 
 static struct my_context *
-my_context_new(const char *name, struct IntArray *array) {
+my_context_new(const char *name, struct IntArray *array, int quant_time) {
   struct my_context *ctx = malloc(sizeof(*ctx));
   ctx->filename = strdup(name);
   ctx->array = array;
+  ctx->quant_time = quant_time;
   return ctx;
 }
 
@@ -105,9 +226,6 @@ my_context_delete(struct my_context *ctx) {
 //     other_function(name, depth + 1);
 // }
 
-int int_gt_comparator(const void *a, const void *b) {
-  return *(int *)a - *(int *)b;
-}
 /**
  * Coroutine body. This code is executed by all the coroutines. Here you
  * implement your solution, sort each individual file.
@@ -117,72 +235,253 @@ coroutine_func_f(void *context) {
   //   struct coro *this = coro_this();
   struct my_context *ctx = context;
 
+  if (is_external_sort) {
+    /* The runs are merged by main() when all the files are done. */
+    int rc = extsort_add_file(&external_sort, ctx->filename);
+    my_context_delete(ctx);
+    return rc == 0 ? 0 : 1;
+  }
+  if (is_streaming) {
+    /* The chunks are merged by the merge coroutine when sorted. */
+    int rc = sortpipe_add_file(&sort_pipe, ctx->filename, split_size,
+                               ctx->quant_time);
+    my_context_delete(ctx);
+    return rc == 0 ? 0 : 1;
+  }
   if (read_integers_from_file(ctx->filename, ctx->array) != 0) {
     printf("Error reading integers from file %s", ctx->filename);
     return 1;
   }
   yield_if_period_end();
 
-  mergesort(ctx->array->data, ctx->array->length, sizeof(int), int_gt_comparator);
+  /*
+   * Big files are split between child coroutines. Radix sort wins on
+   * big arrays, the comparison sort - on small.
+   */
+  int rc = parsort_int(ctx->array->data, ctx->array->length, split_size,
+                       ctx->quant_time);
+  if (rc != 0) {
+    printf("Error sorting file %s", ctx->filename);
+    return 1;
+  }
 
   my_context_delete(ctx);
   /* This will be returned from coro_status(). */
   return 0;
 }
 
+static void
+print_usage(const char *name) {
+  printf("Usage: %s [-j workers] [-p tick_us] [-t] [-m budget_kb] [-S]\n"
+         "          [-s split_size] [-T trace] <latency_us> file...\n"
+         "  -j - sort on that many threads\n"
+         "  -p - check the time quanta by a timer with that period\n"
+         "  -t - do file I/O in helper threads instead of io_uring\n"
+         "  -m - sort externally within that much memory, spilling\n"
+         "       sorted runs to $TMPDIR\n"
+         "  -S - sort files by chunks and stream the merge of all the\n"
+         "       chunks into the result, instead of merging whole files\n"
+         "  -s - sort files with more numbers by chunks of that size\n"
+         "       in parallel, 0 - never split, default %d\n"
+         "  -T - save the scheduler trace to that file: Chrome JSON if\n"
+         "       the name ends with .json, binary otherwise\n",
+         name, PARSORT_CHUNK_SIZE);
+}
+
 int main(int argc, char **argv) {
+  int worker_count = 0;
+  int preempt_tick = 0;
+  long long memory_budget = 0;
+  const char *trace_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:p:tm:Ss:T:")) != -1) {
+    switch (opt) {
+      case 'j':
+        worker_count = atoi(optarg);
+        break;
+      case 'p':
+        preempt_tick = atoi(optarg);
+        break;
+      case 't':
+        coro_io_set_backend(CORO_IO_BACKEND_THREADS);
+        break;
+      case 'm':
+        memory_budget = atoll(optarg) * 1024;
+        is_external_sort = memory_budget > 0;
+        break;
+      case 'S':
+        is_streaming = true;
+        break;
+      case 's':
+        split_size = strtoull(optarg, NULL, 10);
+        break;
+      case 'T':
+        trace_path = optarg;
+        break;
+      default:
+        print_usage(argv[0]);
+        return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
   /* Initialize our coroutine global cooperative scheduler. */
   coro_sched_init();
+  /* Optionally check the quanta by a timer instead of the clock. */
+  if (preempt_tick > 0 && coro_sched_start_preempt(preempt_tick) != 0) {
+    perror("Error starting preemption");
+    return 1;
+  }
+  /* Optionally sort on several threads, still a coroutine per file. */
+  if (worker_count > 0 && coro_sched_start_workers(worker_count) != 0) {
+    perror("Error starting workers");
+    return 1;
+  }
+
+  /* Events of the last ~1M state changes are kept. */
+  if (trace_path != NULL && coro_trace_start(1 << 20) != 0) {
+    perror("Error starting the trace");
+    return 1;
+  }
 
   struct timespec t_time;
   clock_gettime(CLOCK_MONOTONIC, &t_time);
   long long start_time = (t_time.tv_sec * 1000000 + t_time.tv_nsec / 1000);
 
-  int num_of_files = argc - 2;
-  int files_offset = 2;
-  int msec_time_slice = atoi(argv[1]) / num_of_files;
+  int num_of_files = argc - optind - 1;
+  int files_offset = optind + 1;
+  int msec_time_slice = atoi(argv[optind]) / num_of_files;
+  if (is_external_sort &&
+      extsort_create(&external_sort, memory_budget, num_of_files,
+                     msec_time_slice) != 0) {
+    perror("Error: the memory budget is too small");
+    return 1;
+  }
+  /* The external merge is streaming anyway. */
+  if (is_external_sort)
+    is_streaming = false;
+  struct int_writer stream_writer;
+  if (is_streaming) {
+    sortpipe_create(&sort_pipe, num_of_files);
+    if (result_open(&stream_writer) != 0)
+      return 1;
+    coro_new(stream_merge_f, &stream_writer, msec_time_slice);
+  }
 
   /* Initialize memory for arrays and start several coroutines which will process memory */
   struct IntArray **arrays = malloc(sizeof(struct IntArray) * (argc - 1));
   for (int i = 0; i < num_of_files; ++i) {
     struct IntArray *array = malloc(sizeof(struct IntArray));
-    coro_new(coroutine_func_f, my_context_new(argv[i + files_offset], array), msec_time_slice);
+    coro_new(coroutine_func_f, my_context_new(argv[i + files_offset], array, msec_time_slice), msec_time_slice);
     arrays[i] = array;
   }
 
   /* Wait for all the coroutines to end. */
   struct coro *c;
+  int status_rc = 0;
   while ((c = coro_sched_wait()) != NULL) {
+    if (coro_status(c) != 0)
+      status_rc = 1;
     printf("Finished with status: %d, switched count: %lld, worked: %lldus\n",
            coro_status(c),
            coro_switch_count(c),
            coro_total_time_working(c));
+    if (trace_path != NULL) {
+      struct coro_time_stat stat;
+      coro_time_stat(c, &stat);
+      printf("    on CPU: %lldus, ready: %lldus, blocked: %lldus\n",
+             stat.cpu_us, stat.ready_us, stat.blocked_us);
+    }
     coro_delete(c);
   }
+  struct coro_stack_stat stack_stat;
+  coro_stack_stat(&stack_stat);
+  printf("Stacks mapped: %zu (%zu cached, %zuKB), RSS: %zuKB\n",
+         stack_stat.mapped_count, stack_stat.cached_count,
+         stack_stat.mapped_size / 1024, stack_stat.rss / 1024);
+  coro_sched_destroy();
+  if (trace_path != NULL) {
+    coro_trace_stop();
+    size_t len = strlen(trace_path);
+    int rc;
+    if (len >= 5 && strcmp(trace_path + len - 5, ".json") == 0)
+      rc = coro_trace_save_json(trace_path);
+    else
+      rc = coro_trace_save_binary(trace_path);
+    if (rc != 0)
+      perror("Error saving the trace");
+    coro_trace_destroy();
+  }
+  if (parse_time_ns > 0) {
+    printf("Parsed %zuKB in %lldus, %.1fMB/s\n", parse_byte_count / 1024,
+           parse_time_ns / 1000,
+           parse_byte_count * 1000.0 / parse_time_ns);
+  }
 
-  int *res_arr = malloc(0);
-  int res_len = 0;
-  for (int i = 0; i < num_of_files; ++i) {
-    int *temp_dst = malloc((res_len + arrays[i]->length) * sizeof(int));
+  if (is_streaming) {
+    long long first_output_us = sort_pipe.first_output_ns / 1000 - start_time;
+    if (sort_pipe.first_output_ns > 0)
+      printf("First output after %lldus\n", first_output_us);
+    sortpipe_destroy(&sort_pipe);
+    for (int i = 0; i < num_of_files; ++i)
+      free(arrays[i]);
+    free(arrays);
+    if (status_rc != 0) {
+      printf("Error sorting the files");
+      return 1;
+    }
+  } else if (is_external_sort) {
+    int rc = write_external_result();
+    extsort_destroy(&external_sort);
+    for (int i = 0; i < num_of_files; ++i)
+      free(arrays[i]);
+    free(arrays);
+    if (rc != 0) {
+      printf("Error writing to file");
+      return 1;
+    }
+  } else {
+    /* Merge all the sorted files at once into a single buffer. */
+    void **runs = malloc(num_of_files * sizeof(*runs));
+    size_t *run_sizes = malloc(num_of_files * sizeof(*run_sizes));
+    int res_len = 0;
+    for (int i = 0; i < num_of_files; ++i) {
+      runs[i] = arrays[i]->data;
+      run_sizes[i] = arrays[i]->length;
+      res_len += arrays[i]->length;
+    }
+    int *res_arr = malloc(res_len * sizeof(int) + 1);
+    if (res_arr == NULL || merge_k(runs, run_sizes, num_of_files, sizeof(int),
+                                   mergesort_int_comparator, res_arr) != 0) {
+      printf("Error merging the files");
+      return 1;
+    }
+    for (int i = 0; i < num_of_files; ++i) {
+      free(arrays[i]->data);
+      free(arrays[i]);
+    }
+    free(runs);
+    free(run_sizes);
 
-    merge(res_arr, arrays[i]->data, res_len, arrays[i]->length, sizeof(int), int_gt_comparator, temp_dst);
-    free(arrays[i]->data);
-    res_len += arrays[i]->length;
-    free(arrays[i]);
-    free(res_arr);
-    res_arr = temp_dst;
-  }
+    if (write_integers_to_file(res_arr, res_len) != 0) {
+      printf("Error writing to file");
+      return 1;
+    }
 
-  if (write_integers_to_file(res_arr, res_len) != 0) {
-    printf("Error writing to file");
-    return 1;
+    free(res_arr);
+    free(arrays);
   }
 
-  free(res_arr);
-  free(arrays);
-
   clock_gettime(CLOCK_MONOTONIC, &t_time);
   long long total_program_worked = (t_time.tv_sec * 1000000 + t_time.tv_nsec / 1000) - start_time;
+  if (write_time_ns > 0) {
+    printf("Written %zuKB in %lldus, %.1fMB/s\n", write_byte_count / 1024,
+           write_time_ns / 1000,
+           write_byte_count * 1000.0 / write_time_ns);
+  }
   printf("Program worked: %lldus\n", total_program_worked);
 
   return 0;
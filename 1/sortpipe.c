@@ -0,0 +1,291 @@
+#include "sortpipe.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro_io.h"
+#include "intio.h"
+#include "libcoro.h"
+#include "mergesort.h"
+#include "radixsort.h"
+
+/** Size of the text chunks the files are read by. */
+enum { SORTPIPE_READ_CHUNK = 64 * 1024 };
+/** Numbers passed to the writer at once. */
+enum { SORTPIPE_OUT_BATCH = 16 * 1024 };
+
+void sortpipe_create(struct sortpipe *p, int file_count) {
+  memset(p, 0, sizeof(*p));
+  p->lock = (struct coro_spinlock)CORO_SPINLOCK_INITIALIZER;
+  p->waiters = (struct coro_wait_queue)CORO_WAIT_QUEUE_INITIALIZER;
+  p->pending = file_count;
+}
+
+void sortpipe_destroy(struct sortpipe *p) {
+  for (size_t i = 0; i < p->run_count; ++i)
+    free(p->runs[i].data);
+  free(p->runs);
+  p->runs = NULL;
+  p->run_count = 0;
+}
+
+/** One more file or chunk sort to wait for. */
+static void
+sortpipe_hold(struct sortpipe *p) {
+  coro_spin_lock(&p->lock);
+  ++p->pending;
+  coro_spin_unlock(&p->lock);
+}
+
+/**
+ * A file or a chunk sort is over. The sorted run, if any, is added to
+ * the merge, it owns the data from now on.
+ */
+static void
+sortpipe_release(struct sortpipe *p, int rc, int *data, size_t count) {
+  coro_spin_lock(&p->lock);
+  if (rc == 0 && data != NULL && p->run_count == p->run_capacity) {
+    size_t capacity = p->run_capacity * 2 + 8;
+    struct sortpipe_run *runs = realloc(p->runs, capacity * sizeof(*runs));
+    if (runs == NULL) {
+      rc = -1;
+    } else {
+      p->runs = runs;
+      p->run_capacity = capacity;
+    }
+  }
+  if (rc != 0) {
+    free(data);
+    p->is_failed = true;
+  } else if (data != NULL) {
+    p->runs[p->run_count].data = data;
+    p->runs[p->run_count].count = count;
+    ++p->run_count;
+  }
+  if (--p->pending == 0)
+    coro_wait_queue_wake_all(&p->waiters);
+  coro_spin_unlock(&p->lock);
+}
+
+/** A chunk being sorted by a child coroutine. */
+struct sortpipe_sort {
+  struct sortpipe *p;
+  int *data;
+  size_t count;
+};
+
+static int
+sortpipe_sort_f(void *arg) {
+  struct sortpipe_sort *t = arg;
+  int rc;
+  if (t->count >= RADIXSORT_MIN_SIZE)
+    rc = radixsort_int(t->data, t->count);
+  else
+    rc = mergesort(t->data, t->count, sizeof(int), mergesort_int_comparator);
+  sortpipe_release(t->p, rc, t->data, t->count);
+  free(t);
+  return rc;
+}
+
+/** Sort the chunk in a child coroutine, which takes the data. */
+static int
+sortpipe_sort_start(struct sortpipe *p, int *data, size_t count,
+                    int quant_time) {
+  struct sortpipe_sort *t = malloc(sizeof(*t));
+  if (t == NULL) {
+    free(data);
+    return -1;
+  }
+  t->p = p;
+  t->data = data;
+  t->count = count;
+  sortpipe_hold(p);
+  if (coro_new(sortpipe_sort_f, t, quant_time) != NULL)
+    return 0;
+  free(t);
+  sortpipe_release(p, -1, data, count);
+  return -1;
+}
+
+/**
+ * Give the parser a new chunk buffer, sized for the numbers the rest
+ * of the text can have, but no more than @a max.
+ */
+static int
+sortpipe_chunk_new(struct int_parser *parser, size_t text_left,
+                   size_t max) {
+  size_t capacity = text_left / 2 + 1;
+  if (capacity > max)
+    capacity = max;
+  parser->data = malloc(capacity * sizeof(*parser->data));
+  parser->size = 0;
+  parser->capacity = capacity;
+  return parser->data == NULL ? -1 : 0;
+}
+
+static int
+sortpipe_read_file(struct sortpipe *p, const char *filename,
+                   size_t chunk_size, int quant_time) {
+  int fd = coro_open(filename, O_RDONLY, 0);
+  if (fd < 0) {
+    perror("Error opening the file");
+    return -1;
+  }
+  struct stat st;
+  size_t text_left = 0;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    text_left = st.st_size;
+  /*
+   * A chunk is cut after the text which makes it full. The text has
+   * up to a number per 2 bytes, +1 number cut by the previous text.
+   */
+  size_t chunk_max = SIZE_MAX;
+  if (chunk_size > 0)
+    chunk_max = chunk_size + SORTPIPE_READ_CHUNK / 2 + 1;
+  struct int_parser parser;
+  memset(&parser, 0, sizeof(parser));
+  char *text = malloc(SORTPIPE_READ_CHUNK);
+  int rc = -1;
+  if (text != NULL)
+    rc = sortpipe_chunk_new(&parser, text_left, chunk_max);
+  while (rc == 0) {
+    ssize_t len = coro_read(fd, text, SORTPIPE_READ_CHUNK);
+    if (len < 0) {
+      perror("Error reading the file");
+      rc = -1;
+      break;
+    }
+    if (len == 0) {
+      if (int_parser_flush(&parser) != 0) {
+        rc = -1;
+        break;
+      }
+    } else if (int_parser_feed(&parser, text, len) != 0) {
+      printf("Not a number in file %s\n", filename);
+      rc = -1;
+      break;
+    }
+    text_left = text_left > (size_t)len ? text_left - len : 0;
+    if (parser.size > 0 &&
+        (len == 0 || (chunk_size > 0 && parser.size >= chunk_size))) {
+      /* The buffer is sized for the worst case, give the rest back. */
+      int *data = realloc(parser.data, parser.size * sizeof(*data));
+      if (data == NULL)
+        data = parser.data;
+      parser.data = NULL;
+      rc = sortpipe_sort_start(p, data, parser.size, quant_time);
+      if (rc == 0 && len > 0)
+        rc = sortpipe_chunk_new(&parser, text_left, chunk_max);
+    }
+    if (len == 0)
+      break;
+    yield_if_period_end();
+  }
+  free(parser.data);
+  free(text);
+  close(fd);
+  return rc;
+}
+
+int sortpipe_add_file(struct sortpipe *p, const char *filename,
+                      size_t chunk_size, int quant_time) {
+  int rc = sortpipe_read_file(p, filename, chunk_size, quant_time);
+  sortpipe_release(p, rc, NULL, 0);
+  return rc;
+}
+
+int sortpipe_wait(struct sortpipe *p) {
+  coro_spin_lock(&p->lock);
+  while (p->pending > 0)
+    coro_wait_queue_wait(&p->waiters, &p->lock);
+  int rc = p->is_failed ? -1 : 0;
+  coro_spin_unlock(&p->lock);
+  return rc;
+}
+
+/** Numbers of a run not merged yet. */
+struct sortpipe_cursor {
+  const int *pos;
+  const int *end;
+};
+
+/**
+ * True, if the cursor @a a has a smaller head than @a b. The
+ * loser_tree_before_f of the merge, @a ctx is the cursors.
+ */
+static inline bool
+sortpipe_cursor_before(const void *ctx, size_t a, size_t b) {
+  const struct sortpipe_cursor *cursors = ctx;
+  const struct sortpipe_cursor *ca = &cursors[a];
+  const struct sortpipe_cursor *cb = &cursors[b];
+  if (ca->pos == ca->end)
+    return false;
+  if (cb->pos == cb->end)
+    return true;
+  return *ca->pos < *cb->pos || (*ca->pos == *cb->pos && a < b);
+}
+
+/** Pass the merged numbers on, noting when the first ones went. */
+static int
+sortpipe_write(struct sortpipe *p, struct int_writer *writer,
+               const int *data, size_t count) {
+  if (p->first_output_ns == 0 && count > 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    p->first_output_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+  return int_writer_write(writer, data, count);
+}
+
+int sortpipe_merge(struct sortpipe *p, struct int_writer *writer) {
+  size_t k = p->run_count;
+  if (k == 0)
+    return 0;
+  struct sortpipe_cursor *cursors = calloc(k, sizeof(*cursors));
+  struct loser_tree tree;
+  int *out = malloc(SORTPIPE_OUT_BATCH * sizeof(*out));
+  int rc = loser_tree_create(&tree, k);
+  if (cursors == NULL || out == NULL)
+    rc = -1;
+  if (rc != 0)
+    goto out;
+  for (size_t i = 0; i < k; ++i) {
+    cursors[i].pos = p->runs[i].data;
+    cursors[i].end = p->runs[i].data + p->runs[i].count;
+  }
+  loser_tree_build(&tree, sortpipe_cursor_before, cursors);
+  size_t winner = tree.winner;
+  size_t out_size = 0;
+  while (true) {
+    struct sortpipe_cursor *c = &cursors[winner];
+    if (c->pos == c->end)
+      break;
+    out[out_size++] = *c->pos++;
+    if (out_size == SORTPIPE_OUT_BATCH) {
+      if (sortpipe_write(p, writer, out, out_size) != 0) {
+        rc = -1;
+        goto out;
+      }
+      out_size = 0;
+      yield_if_period_end();
+    }
+    /* The run is merged out, it is not needed anymore. */
+    if (c->pos == c->end) {
+      free(p->runs[winner].data);
+      p->runs[winner].data = NULL;
+    }
+    winner = loser_tree_replay(&tree, sortpipe_cursor_before, cursors);
+  }
+  rc = sortpipe_write(p, writer, out, out_size);
+out:
+  free(cursors);
+  loser_tree_destroy(&tree);
+  free(out);
+  return rc;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "coro_sync.h"
+
+struct int_writer;
+
+/**
+ * Streaming sort of files. Each file is parsed chunk by chunk, and
+ * every chunk is sorted by a child coroutine as soon as it is cut,
+ * while the file keeps being read. The sorted chunks are published
+ * as runs of one K-way merge, which streams the merged numbers into
+ * a writer. Nothing is merged into an intermediate buffer, and each
+ * run is freed as soon as it is merged out.
+ *
+ * The first number can go out only when every run is sorted: any of
+ * them can hold the smallest one.
+ */
+
+/** A sorted chunk of a file. */
+struct sortpipe_run {
+  int *data;
+  size_t count;
+};
+
+struct sortpipe {
+  /** Protects all the members below. */
+  struct coro_spinlock lock;
+  /** Published runs. Appended from several threads. */
+  struct sortpipe_run *runs;
+  size_t run_count;
+  size_t run_capacity;
+  /** Files being read and chunks being sorted. */
+  size_t pending;
+  /** The merge, waiting for the pending runs. */
+  struct coro_wait_queue waiters;
+  /** True, if a file could not be read or sorted. */
+  bool is_failed;
+  /** When the first number was written, CLOCK_MONOTONIC ns. */
+  long long first_output_ns;
+};
+
+/** Prepare for sorting @a file_count files, none is pending yet. */
+void sortpipe_create(struct sortpipe *p, int file_count);
+
+/**
+ * Read the file and sort it by chunks of @a chunk_size numbers, in
+ * child coroutines with the quantum @a quant_time. 0 - the whole
+ * file is one chunk. Returns when the file is read, its chunks can
+ * still be in sorting. Must be called from a coroutine, once for
+ * each file given to sortpipe_create().
+ * @retval 0 Success.
+ * @retval -1 Error, reported to stdout. The merge fails too.
+ */
+int sortpipe_add_file(struct sortpipe *p, const char *filename,
+                      size_t chunk_size, int quant_time);
+
+/**
+ * Wait until all the files are read and all their runs are sorted.
+ * Must be called from a coroutine.
+ * @retval 0 Success.
+ * @retval -1 A file has failed.
+ */
+int sortpipe_wait(struct sortpipe *p);
+
+/**
+ * Merge the runs into the writer, freeing each one as soon as it is
+ * merged out. Must be called after sortpipe_wait().
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int sortpipe_merge(struct sortpipe *p, struct int_writer *writer);
+
+/** Free the runs not merged. */
+void sortpipe_destroy(struct sortpipe *p);
@@ -5,11 +5,9 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
-};
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 enum token_type {
 	TOKEN_TYPE_NONE,
@@ -30,12 +28,128 @@ struct token {
 	uint32_t capacity;
 };
 
+/** Where the tokenizer has stopped, see parser_next_token(). */
+enum token_state {
+	/** Skipping spaces before a token. */
+	TOKEN_STATE_SPACE,
+	/** Inside a word, maybe quoted. */
+	TOKEN_STATE_WORD,
+	/** After a backslash in a word. */
+	TOKEN_STATE_ESCAPE,
+	/** After the first char of an operator: &, | or >. */
+	TOKEN_STATE_OPERATOR,
+	/** Inside a comment, until the end of the line. */
+	TOKEN_STATE_COMMENT,
+};
+
+/** What the line being built expects next. */
+enum line_state {
+	/** Commands and operators between them. */
+	LINE_STATE_EXPR,
+	/** A file name after > or >>. */
+	LINE_STATE_OUT_FILE,
+	/** & or the line end after the output file. */
+	LINE_STATE_OUT_END,
+	/** The line end. */
+	LINE_STATE_END,
+	/** The rest of a bad line, until its end. */
+	LINE_STATE_SKIP,
+};
+
+struct parser {
+	char *buffer;
+	uint32_t size;
+	uint32_t capacity;
+	/**
+	 * Start of the bytes not parsed yet. The ones before it are
+	 * already in the token or the line, and are dropped lazily by
+	 * parser_reserve().
+	 */
+	uint32_t pos;
+	/**
+	 * The tokenizer state. A token and a line can be cut by the
+	 * end of the fed data. Then they are continued on the next
+	 * parser_pop_next() from the same place instead of reparsing.
+	 */
+	enum token_state token_state;
+	/** The open quote of the current word, or 0. */
+	char quote;
+	/** The first char of the operator being read. */
+	char op;
+	struct token token;
+	/** The line being built, NULL if nothing is there yet. */
+	struct command_line *line;
+	enum line_state line_state;
+	/** The error of the line being skipped. */
+	enum parser_error error;
+};
+
+/**
+ * A chunk of a command line's memory. The line, its exprs, args and
+ * strings are all carved from the chunks by bumping a pointer, and
+ * are freed all at once with the chunks.
+ */
+struct line_chunk {
+	/** The previous chunk, allocated before this one. */
+	struct line_chunk *next;
+	uint32_t size;
+	uint32_t capacity;
+	char data[];
+};
+
+/** Size of the first chunk, enough for a typical line. */
+enum { LINE_CHUNK_SIZE = 512 };
+
+/** Create a line, it is the first object in its own first chunk. */
+static struct command_line *
+command_line_new(void)
+{
+	struct line_chunk *c = malloc(sizeof(*c) + LINE_CHUNK_SIZE);
+	c->next = NULL;
+	c->size = sizeof(struct command_line);
+	c->capacity = LINE_CHUNK_SIZE;
+	struct command_line *line = (struct command_line *)c->data;
+	memset(line, 0, sizeof(*line));
+	line->mem = c;
+	return line;
+}
+
+/** Allocate memory owned by the line. */
+static void *
+command_line_alloc(struct command_line *line, uint32_t size, uint32_t align)
+{
+	struct line_chunk *c = line->mem;
+	uint32_t pos = (c->size + align - 1) & ~(align - 1);
+	if (pos + size > c->capacity) {
+		uint32_t capacity = c->capacity * 2;
+		if (capacity < size)
+			capacity = size;
+		struct line_chunk *next = malloc(sizeof(*next) + capacity);
+		next->next = c;
+		next->capacity = capacity;
+		line->mem = next;
+		c = next;
+		pos = 0;
+	}
+	c->size = pos + size;
+	return c->data + pos;
+}
+
+static struct expr *
+command_line_new_expr(struct command_line *line, enum expr_type type)
+{
+	struct expr *e = command_line_alloc(line, sizeof(*e),
+					    _Alignof(struct expr));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
+}
+
 static char *
-token_strdup(const struct token *t)
+token_strdup(struct command_line *line, const struct token *t)
 {
 	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
+	char *res = command_line_alloc(line, t->size + 1, 1);
 	memcpy(res, t->data, t->size);
 	res[t->size] = 0;
 	return res;
@@ -53,6 +167,19 @@ token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+static void
+token_append_n(struct token *t, const char *data, uint32_t size)
+{
+	if (t->capacity - t->size < size) {
+		t->capacity = (t->capacity + 1) * 2;
+		if (t->capacity - t->size < size)
+			t->capacity = t->size + size;
+		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+	}
+	memcpy(t->data + t->size, data, size);
+	t->size += size;
+}
+
 static void
 token_reset(struct token *t)
 {
@@ -61,11 +188,16 @@ token_reset(struct token *t)
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct command_line *line, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
+		/* The old array stays in the arena until the line is deleted. */
 		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		char **args = command_line_alloc(line,
+			sizeof(*args) * cmd->arg_capacity, _Alignof(char *));
+		if (cmd->arg_count > 0)
+			memcpy(args, cmd->args, sizeof(*args) * cmd->arg_count);
+		cmd->args = args;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
@@ -75,20 +207,13 @@ command_append_arg(struct command *cmd, char *arg)
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+	/* The line itself is in the last chunk. */
+	struct line_chunk *c = line->mem;
+	while (c != NULL) {
+		struct line_chunk *next = c->next;
+		free(c);
+		c = next;
 	}
-	free(line->out_file);
-	free(line);
 }
 
 static void
@@ -107,336 +232,460 @@ parser_new(void)
 	return calloc(1, sizeof(struct parser));
 }
 
-void
-parser_feed(struct parser *p, const char *str, uint32_t len)
+char *
+parser_reserve(struct parser *p, uint32_t len)
 {
-	uint32_t cap = p->capacity - p->size;
-	if (cap < len) {
-		uint32_t new_capacity = (p->capacity + 1) * 2;
-		if (new_capacity - p->size < len)
-			new_capacity = p->size + len;
-		p->buffer = realloc(p->buffer, sizeof(*p->buffer) * new_capacity);
-		p->capacity = new_capacity;
+	if (p->capacity - p->size >= len)
+		return p->buffer + p->size;
+	/*
+	 * The parsed bytes are dropped only now, when the space is
+	 * needed, and only if they are at least a half of the buffer.
+	 * So each byte is moved O(1) times on average.
+	 */
+	uint32_t unparsed = p->size - p->pos;
+	if (p->pos >= unparsed && p->capacity - unparsed >= len) {
+		memmove(p->buffer, p->buffer + p->pos, unparsed);
+		p->pos = 0;
+		p->size = unparsed;
+		return p->buffer + p->size;
 	}
-	memcpy(p->buffer + p->size, str, len);
+	uint32_t new_capacity = (p->capacity + 1) * 2;
+	if (new_capacity - p->size < len)
+		new_capacity = p->size + len;
+	p->buffer = realloc(p->buffer, sizeof(*p->buffer) * new_capacity);
+	p->capacity = new_capacity;
+	return p->buffer + p->size;
+}
+
+void
+parser_commit(struct parser *p, uint32_t len)
+{
 	p->size += len;
 	assert(p->size <= p->capacity);
 }
 
-static void
-parser_consume(struct parser *p, uint32_t size)
+void
+parser_feed(struct parser *p, const char *str, uint32_t len)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
-		p->size = 0;
-		return;
+	memcpy(parser_reserve(p, len), str, len);
+	parser_commit(p, len);
+}
+
+/** True, if the byte can't be just appended to a word in that quote. */
+static inline bool
+word_is_special(char c, char quote)
+{
+	switch (quote) {
+	case '\'':
+		return c == '\'';
+	case '"':
+		return c == '"' || c == '\\';
+	default:
+		switch (c) {
+		case '\'':
+		case '"':
+		case '\\':
+		case '&':
+		case '|':
+		case '>':
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+		case '#':
+			return true;
+		default:
+			return false;
+		}
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
 }
 
+/**
+ * Length of the run of plain bytes from @a pos, which are appended to
+ * a word in that quote as is. Long arguments, like quoted texts, are
+ * scanned by 16 bytes with SSE2 and copied in one go.
+ */
 static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+word_plain_len(const char *pos, const char *end, char quote)
 {
-	token_reset(out);
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
+#ifdef __SSE2__
+	if (quote == 0) {
+		const __m128i quote1 = _mm_set1_epi8('\'');
+		const __m128i quote2 = _mm_set1_epi8('"');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		const __m128i amp = _mm_set1_epi8('&');
+		const __m128i bar = _mm_set1_epi8('|');
+		const __m128i greater = _mm_set1_epi8('>');
+		const __m128i space = _mm_set1_epi8(' ');
+		const __m128i tab = _mm_set1_epi8('\t');
+		const __m128i cr = _mm_set1_epi8('\r');
+		const __m128i lf = _mm_set1_epi8('\n');
+		const __m128i hash = _mm_set1_epi8('#');
+		for (; end - pos >= 16; pos += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)pos);
+			__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, quote1),
+					     _mm_cmpeq_epi8(v, quote2)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, backslash),
+					     _mm_cmpeq_epi8(v, amp)));
+			m = _mm_or_si128(m, _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, bar),
+					     _mm_cmpeq_epi8(v, greater)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, space),
+					     _mm_cmpeq_epi8(v, tab))));
+			m = _mm_or_si128(m, _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+					     _mm_cmpeq_epi8(v, lf)),
+				_mm_cmpeq_epi8(v, hash)));
+			int mask = _mm_movemask_epi8(m);
+			if (mask != 0)
+				return pos - begin + __builtin_ctz(mask);
+		}
+	} else {
+		/* In single quotes the second char is never met. */
+		const __m128i special1 = _mm_set1_epi8(quote);
+		const __m128i special2 = _mm_set1_epi8(quote == '"' ? '\\' : quote);
+		for (; end - pos >= 16; pos += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)pos);
+			int mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(v, special1),
+				_mm_cmpeq_epi8(v, special2)));
+			if (mask != 0)
+				return pos - begin + __builtin_ctz(mask);
 		}
-		++pos;
 	}
-	char quote = 0;
-	while (pos < end) {
-		char c = *pos;
-		switch(c) {
-		case '\'':
-		case '"':
-			if (quote == 0) {
-				quote = c;
-				++pos;
-				if (pos == end)
-					return 0;
-				continue;
-			}
-			if (quote != c)
-				goto append_and_next;
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\\':
-			if (quote == '\'')
-				goto append_and_next;
-			if (quote == '"') {
+#endif
+	while (pos < end && !word_is_special(*pos, quote))
+		++pos;
+	return pos - begin;
+}
+
+/**
+ * Take the next token from the fed data. Each byte is looked at once,
+ * except for the ones ending a word without being a part of it, like
+ * '|' in "ls|wc". At the end of the data the state is kept in the
+ * parser, and the same token is continued by the next call.
+ * @retval true The token is complete.
+ * @retval false Need more data.
+ */
+static bool
+parser_next_token(struct parser *p)
+{
+	struct token *t = &p->token;
+	const char *buffer = p->buffer;
+	uint32_t pos = p->pos;
+	uint32_t end = p->size;
+	bool is_done = false;
+	while (!is_done && pos < end) {
+		char c = buffer[pos];
+		switch (p->token_state) {
+		case TOKEN_STATE_SPACE:
+			if (c == '\n') {
+				t->type = TOKEN_TYPE_NEW_LINE;
+				is_done = true;
 				++pos;
-				if (pos == end)
-					return 0;
-				c = *pos;
-				switch (c)
-				{
-				case '\\':
-					goto append_and_next;
-				case '\n':
-					++pos;
-					continue;
-				case '"':
-					goto append_and_next;
-				default:
-					break;
-				}
-				token_append(out, '\\');
-				goto append_and_next;
+				break;
 			}
-			assert(quote == 0);
-			++pos;
-			if (pos == end)
-				return 0;
-			c = *pos;
-			if (c == '\n') {
+			if (isspace(c)) {
 				++pos;
-				continue;
+				break;
 			}
-			goto append_and_next;
-		case '&':
-		case '|':
-		case '>':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+			p->token_state = TOKEN_STATE_WORD;
+			break;
+		case TOKEN_STATE_WORD: {
+			uint32_t len = word_plain_len(buffer + pos, buffer + end,
+						      p->quote);
+			if (len > 0) {
+				token_append_n(t, buffer + pos, len);
+				pos += len;
+				break;
 			}
 			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_AND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_OR;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
-					break;
-				default:
-					assert(false);
-					break;
+			switch (c) {
+			case '\'':
+			case '"':
+				if (p->quote == 0) {
+					p->quote = c;
+				} else if (p->quote == c) {
+					p->quote = 0;
+					t->type = TOKEN_TYPE_STR;
+					is_done = true;
+				} else {
+					token_append(t, c);
 				}
-				++pos;
-			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
-					break;
-				default:
-					assert(false);
-					break;
+				break;
+			case '\\':
+				if (p->quote == '\'')
+					token_append(t, c);
+				else
+					p->token_state = TOKEN_STATE_ESCAPE;
+				break;
+			case '&':
+			case '|':
+			case '>':
+				if (p->quote != 0) {
+					token_append(t, c);
+				} else if (t->size > 0) {
+					/* The operator is the next token. */
+					--pos;
+					t->type = TOKEN_TYPE_STR;
+					is_done = true;
+				} else {
+					p->token_state = TOKEN_STATE_OPERATOR;
+					p->op = c;
 				}
+				break;
+			case ' ':
+			case '\t':
+			case '\r':
+				if (p->quote != 0) {
+					token_append(t, c);
+				} else if (t->size > 0) {
+					t->type = TOKEN_TYPE_STR;
+					is_done = true;
+				} else {
+					/* Only an escaped new line was there. */
+					p->token_state = TOKEN_STATE_SPACE;
+				}
+				break;
+			case '\n':
+			case '#':
+				if (p->quote != 0) {
+					token_append(t, c);
+				} else if (t->size > 0) {
+					--pos;
+					t->type = TOKEN_TYPE_STR;
+					is_done = true;
+				} else if (c == '#') {
+					p->token_state = TOKEN_STATE_COMMENT;
+				} else {
+					--pos;
+					p->token_state = TOKEN_STATE_SPACE;
+				}
+				break;
+			default:
+				token_append(t, c);
+				break;
 			}
-			return pos - begin;
-		case ' ':
-		case '\t':
-		case '\r':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\n':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos - begin;
-		case '#':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
-			}
+			break;
+		}
+		case TOKEN_STATE_ESCAPE:
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
+			p->token_state = TOKEN_STATE_WORD;
+			/* An escaped new line is skipped both in and out of quotes. */
+			if (c == '\n')
+				break;
+			if (p->quote == '"' && c != '\\' && c != '"')
+				token_append(t, '\\');
+			token_append(t, c);
+			break;
+		case TOKEN_STATE_OPERATOR:
+			if (c == p->op)
 				++pos;
+			switch (p->op) {
+			case '&':
+				t->type = c == p->op ? TOKEN_TYPE_AND :
+					TOKEN_TYPE_BACKGROUND;
+				break;
+			case '|':
+				t->type = c == p->op ? TOKEN_TYPE_OR : TOKEN_TYPE_PIPE;
+				break;
+			case '>':
+				t->type = c == p->op ? TOKEN_TYPE_OUT_APPEND :
+					TOKEN_TYPE_OUT_NEW;
+				break;
+			default:
+				assert(false);
+				break;
 			}
-			return 0;
+			is_done = true;
+			break;
+		case TOKEN_STATE_COMMENT:
+			++pos;
+			if (c == '\n') {
+				t->type = TOKEN_TYPE_NEW_LINE;
+				is_done = true;
+			}
+			break;
 		default:
-			goto append_and_next;
+			assert(false);
+			break;
 		}
-	append_and_next:
-		token_append(out, c);
-		++pos;
 	}
-	return 0;
+	p->pos = pos;
+	if (is_done)
+		p->token_state = TOKEN_STATE_SPACE;
+	return is_done;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+/** Get the line being built, create if there is none yet. */
+static struct command_line *
+parser_line(struct parser *p)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
+	if (p->line == NULL)
+		p->line = command_line_new();
+	return p->line;
+}
+
+/** Drop the current line, skip the rest of it and report @a err. */
+static void
+parser_fail_line(struct parser *p, enum parser_error err)
+{
+	p->error = err;
+	p->line_state = LINE_STATE_SKIP;
+}
 
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
+/** Append an operator expression after a command. */
+static void
+parser_append_operator(struct parser *p, enum expr_type type,
+		       enum parser_error no_left_arg,
+		       enum parser_error left_arg_not_a_command)
+{
+	struct command_line *line = parser_line(p);
+	if (line->tail == NULL) {
+		parser_fail_line(p, no_left_arg);
+		return;
+	}
+	if (line->tail->type != EXPR_TYPE_COMMAND) {
+		parser_fail_line(p, left_arg_not_a_command);
+		return;
+	}
+	command_line_append(line, command_line_new_expr(line, type));
+}
+
+/**
+ * Handle a complete token according to the line state.
+ * @retval true The line is over, either built or failed.
+ * @retval false The line goes on.
+ */
+static bool
+parser_handle_token(struct parser *p)
+{
+	struct token *t = &p->token;
+	struct command_line *line;
+	struct expr *e;
+	switch (p->line_state) {
+	case LINE_STATE_EXPR:
+		switch (t->type) {
 		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
-				continue;
+			line = parser_line(p);
+			if (line->tail != NULL &&
+			    line->tail->type == EXPR_TYPE_COMMAND) {
+				command_append_arg(line, &line->tail->cmd,
+						   token_strdup(line, t));
+				return false;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
+			e = command_line_new_expr(line, EXPR_TYPE_COMMAND);
+			e->cmd.exe = token_strdup(line, t);
 			command_line_append(line, e);
-			continue;
+			return false;
 		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
+			/* Skip empty lines. */
+			if (p->line == NULL || p->line->tail == NULL)
+				return false;
+			return true;
 		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
-			continue;
+			parser_append_operator(p, EXPR_TYPE_PIPE,
+				PARSER_ERR_PIPE_WITH_NO_LEFT_ARG,
+				PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND);
+			return false;
 		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
-			continue;
+			parser_append_operator(p, EXPR_TYPE_AND,
+				PARSER_ERR_AND_WITH_NO_LEFT_ARG,
+				PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND);
+			return false;
 		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
-			continue;
+			parser_append_operator(p, EXPR_TYPE_OR,
+				PARSER_ERR_OR_WITH_NO_LEFT_ARG,
+				PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND);
+			return false;
 		case TOKEN_TYPE_OUT_NEW:
+			parser_line(p)->out_type = OUTPUT_TYPE_FILE_NEW;
+			p->line_state = LINE_STATE_OUT_FILE;
+			return false;
 		case TOKEN_TYPE_OUT_APPEND:
+			parser_line(p)->out_type = OUTPUT_TYPE_FILE_APPEND;
+			p->line_state = LINE_STATE_OUT_FILE;
+			return false;
 		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
+			parser_line(p)->is_background = true;
+			p->line_state = LINE_STATE_END;
+			return false;
 		default:
 			assert(false);
+			return false;
 		}
-	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
-		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+	case LINE_STATE_OUT_FILE:
+		if (t->type != TOKEN_TYPE_STR) {
+			parser_fail_line(p, PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+			return t->type == TOKEN_TYPE_NEW_LINE;
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
-	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
-
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
+		p->line->out_file = token_strdup(p->line, t);
+		p->line_state = LINE_STATE_OUT_END;
+		return false;
+	case LINE_STATE_OUT_END:
+		if (t->type == TOKEN_TYPE_BACKGROUND) {
+			p->line->is_background = true;
+			p->line_state = LINE_STATE_END;
+			return false;
 		}
+		/* Fall through. */
+	case LINE_STATE_END:
+		if (t->type == TOKEN_TYPE_NEW_LINE)
+			return true;
+		parser_fail_line(p, PARSER_ERR_TOO_LATE_ARGUMENTS);
+		return false;
+	case LINE_STATE_SKIP:
+		/*
+		 * The line can't be executed, but the parser can't just
+		 * crash because of that - its rest is skipped.
+		 */
+		return t->type == TOKEN_TYPE_NEW_LINE;
+	default:
+		assert(false);
+		return false;
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+}
 
-return_no_line:
-	command_line_delete(line);
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
 	*out = NULL;
-
-return_final:
-	free(token.data);
+	enum parser_error res = PARSER_ERR_NONE;
+	while (parser_next_token(p)) {
+		bool is_line_end = parser_handle_token(p);
+		token_reset(&p->token);
+		if (!is_line_end)
+			continue;
+		struct command_line *line = p->line;
+		p->line = NULL;
+		res = p->error;
+		if (res == PARSER_ERR_NONE &&
+		    (line->tail == NULL || line->tail->type != EXPR_TYPE_COMMAND))
+			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		if (res == PARSER_ERR_NONE)
+			*out = line;
+		else if (line != NULL)
+			command_line_delete(line);
+		p->error = PARSER_ERR_NONE;
+		p->line_state = LINE_STATE_EXPR;
+		break;
+	}
+	/* All parsed, the buffer can be reused from the start for free. */
+	if (p->pos == p->size) {
+		p->pos = 0;
+		p->size = 0;
+	}
 	return res;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	if (p->line != NULL)
+		command_line_delete(p->line);
+	free(p->token.data);
 	free(p->buffer);
 	free(p);
 }
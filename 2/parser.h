@@ -45,6 +45,13 @@ enum output_type {
 	OUTPUT_TYPE_FILE_APPEND,
 };
 
+struct line_chunk;
+
+/**
+ * A parsed line. The line, its exprs and all their strings live in
+ * one arena, freed by command_line_delete() at once. They must not be
+ * freed or reallocated one by one.
+ */
 struct command_line {
 	struct expr *head;
 	struct expr *tail;
@@ -52,6 +59,8 @@ struct command_line {
 	/** Valid if the out type is FILE. */
 	char *out_file;
 	bool is_background;
+	/** The arena of the line. */
+	struct line_chunk *mem;
 };
 
 void
@@ -63,6 +72,19 @@ parser_new(void);
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
+/**
+ * Get at least @a len bytes of free space in the parser's buffer, to
+ * read the input right there without an intermediate copy. The
+ * pointer is valid until the next call of any parser function. The
+ * bytes actually written are added to the input by parser_commit().
+ */
+char *
+parser_reserve(struct parser *p, uint32_t len);
+
+/** Add @a len bytes written into the reserved space to the input. */
+void
+parser_commit(struct parser *p, uint32_t len);
+
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
@@ -0,0 +1,118 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Parse throughput benchmark. A script of the same kind of lines as
+ * in the tests is fed to the parser by 1KB chunks, like the shell
+ * reads its input, and all the lines are popped and deleted.
+ */
+
+/**
+ * Lines like in tests.txt: pipes, quotes, redirects, comments, long
+ * quoted texts.
+ */
+static const char *script_lines[] = {
+	"mkdir testdir\n",
+	"cd testdir\n",
+	"   pwd | tail -c 8\n",
+	"echo \"a\n\n\n\nb\" | cat -s\n",
+	"touch \"my file with whitespaces in name.txt\"\n",
+	"echo '123 456 \\\" str \\\"' > \"my file with whitespaces in name.txt\"\n",
+	"cat my\\ file\\ with\\ whitespaces\\ in\\ name.txt\n",
+	"echo \"test 'test'' \\\\\" >> \"my file with whitespaces in name.txt\"\n",
+	"echo 100|grep 100\n",
+	"yes bigdata | head -n 100000 | wc -l | tr -d [:blank:]\n",
+	"# Comment line\n",
+	"echo 100 # comment ' ' \\ \\\n",
+	"false && echo 123 || echo 456\n",
+	"sleep 0.1 && echo test &\n",
+	"printf \"import time\\ntime.sleep(0.1)\\n\" > test.py\n",
+	/* Long payloads. */
+	"echo \"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed "
+	"do eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut "
+	"enim ad minim veniam, quis nostrud exercitation ullamco laboris "
+	"nisi ut aliquip ex ea commodo consequat.\" > lorem.txt\n",
+	"printf 'x=%s;%s\\n' /usr/local/share/some/really/long/path/to/file.txt "
+	"'https://example.com/a/very/long/url?with=query&and=more' | tr a-z A-Z\n",
+};
+
+/** Script size is about that, in bytes. */
+enum { SCRIPT_SIZE = 4 * 1024 * 1024 };
+/** Size of the chunks the script is fed by. */
+enum { FEED_SIZE = 1024 };
+enum { RUN_COUNT = 5 };
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return (l > r) - (l < r);
+}
+
+/** Parse the whole script, return the line count. */
+static long long
+parse_script(const char *script, size_t size)
+{
+	struct parser *p = parser_new();
+	long long count = 0;
+	for (size_t pos = 0; pos < size; pos += FEED_SIZE) {
+		uint32_t len = size - pos < FEED_SIZE ? size - pos : FEED_SIZE;
+		memcpy(parser_reserve(p, len), script + pos, len);
+		parser_commit(p, len);
+		while (true) {
+			struct command_line *line = NULL;
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			++count;
+			if (line != NULL)
+				command_line_delete(line);
+		}
+	}
+	parser_delete(p);
+	return count;
+}
+
+int
+main(void)
+{
+	size_t line_count = sizeof(script_lines) / sizeof(script_lines[0]);
+	char *script = malloc(SCRIPT_SIZE + 1024);
+	size_t size = 0;
+	for (size_t i = 0; size < SCRIPT_SIZE; i = (i + 1) % line_count) {
+		size_t len = strlen(script_lines[i]);
+		memcpy(script + size, script_lines[i], len);
+		size += len;
+	}
+	/* Warm up. */
+	parse_script(script, size);
+	double samples[RUN_COUNT];
+	long long count = 0;
+	for (int run = 0; run < RUN_COUNT; ++run) {
+		long long start = now_ns();
+		count = parse_script(script, size);
+		double duration = (now_ns() - start) / 1e9;
+		samples[run] = count / duration;
+	}
+	qsort(samples, RUN_COUNT, sizeof(*samples), double_cmp);
+	printf("Parse %lld lines, %zuKB, by %d byte chunks\n", count,
+	       size / 1024, FEED_SIZE);
+	printf("    min: %.0f lines/sec\n", samples[0]);
+	printf("    med: %.0f lines/sec\n", samples[RUN_COUNT / 2]);
+	printf("    max: %.0f lines/sec\n", samples[RUN_COUNT - 1]);
+	free(script);
+	return 0;
+}
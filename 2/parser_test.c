@@ -773,6 +773,143 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_chunked_script(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/*
+	 * Lines and quoted strings are cut by the chunk ends at all the
+	 * possible places. The tokens are continued, not reparsed.
+	 */
+	const char *str = "echo \"a b\" 'c\nd' e\\\nf | grep x >> out.txt &\n";
+	uint32_t len = strlen(str);
+	const int line_count = 100;
+	for (uint32_t chunk = 1; chunk <= len + 1; ++chunk) {
+		int count = 0;
+		uint32_t total = len * line_count;
+		for (uint32_t sent = 0; sent < total; sent += chunk) {
+			uint32_t size = total - sent < chunk ? total - sent : chunk;
+			for (uint32_t i = 0; i < size; ++i)
+				parser_feed(p, &str[(sent + i) % len], 1);
+			while (true) {
+				enum parser_error err = parser_pop_next(p, &line);
+				unit_fail_if(err != PARSER_ERR_NONE);
+				if (line == NULL)
+					break;
+				struct expr *e = line->head;
+				unit_fail_if(strcmp(e->cmd.exe, "echo") != 0);
+				unit_fail_if(e->cmd.arg_count != 3);
+				unit_fail_if(strcmp(e->cmd.args[0], "a b") != 0);
+				unit_fail_if(strcmp(e->cmd.args[1], "c\nd") != 0);
+				unit_fail_if(strcmp(e->cmd.args[2], "ef") != 0);
+				unit_fail_if(e->next->type != EXPR_TYPE_PIPE);
+				e = e->next->next;
+				unit_fail_if(strcmp(e->cmd.exe, "grep") != 0);
+				unit_fail_if(line->out_type != OUTPUT_TYPE_FILE_APPEND);
+				unit_fail_if(strcmp(line->out_file, "out.txt") != 0);
+				unit_fail_if(!line->is_background);
+				command_line_delete(line);
+				++count;
+			}
+		}
+		unit_fail_if(count != line_count);
+	}
+	unit_check(true, "all the lines in all the chunk sizes");
+
+	unit_msg("Incomplete line at the end");
+	parser_feed(p, "echo \"unfinished", 16);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no line yet");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_empty_string(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "printf '' \"\" x\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "printf") == 0, "exe");
+	unit_check(e->cmd.arg_count == 3, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "") == 0, "arg[1]");
+	unit_check(strcmp(e->cmd.args[2], "x") == 0, "arg[2]");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_reserve_commit(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	char *buf = parser_reserve(p, 64);
+	unit_check(buf != NULL, "reserve");
+	memcpy(buf, "ls -l\npw", 8);
+	parser_commit(p, 8);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe");
+	unit_check(line->head->cmd.arg_count == 1, "arg count");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no line yet");
+
+	unit_msg("Parsed bytes are dropped to make space");
+	for (int i = 0; i < 1000; ++i) {
+		buf = parser_reserve(p, 7);
+		memcpy(buf, "d\necho ", 7);
+		parser_commit(p, 7);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line == NULL);
+		const struct expr *e = line->head;
+		if (i == 0) {
+			unit_fail_if(strcmp(e->cmd.exe, "pwd") != 0);
+			unit_fail_if(e->cmd.arg_count != 0);
+		} else {
+			unit_fail_if(strcmp(e->cmd.exe, "echo") != 0);
+			unit_fail_if(e->cmd.arg_count != 1);
+			unit_fail_if(strcmp(e->cmd.args[0], "d") != 0);
+		}
+		command_line_delete(line);
+	}
+	unit_check(true, "lines cut by the reserved chunks");
+
+	unit_msg("Many lines in one chunk");
+	const char *str = "a\nb\nc\n";
+	parser_feed(p, "d\n", 2);
+	parser_feed(p, str, strlen(str));
+	const char *exes[] = {"echo", "a", "b", "c"};
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		const struct expr *e = line->head;
+		unit_fail_if(strcmp(e->cmd.exe, exes[i]) != 0);
+		unit_fail_if(e->cmd.arg_count != (i == 0 ? 1 : 0));
+		unit_fail_if(i == 0 && strcmp(e->cmd.args[0], "d") != 0);
+		command_line_delete(line);
+		/* Growth with the parsed bytes in the buffer. */
+		parser_reserve(p, 100 * (i + 1));
+	}
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "all lines are parsed");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -809,6 +946,15 @@ test_errors(void)
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 
+	unit_msg("Redirect without a file doesn't take the next line");
+	parser_feed(p, "exe >\necho\n", 11);
+	unit_check(parser_pop_next(p, &line) ==
+		   PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG, "parse error");
+	unit_check(line == NULL, "no line");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0, "next line");
+	command_line_delete(line);
+
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
 	unit_check(line->head->type == EXPR_TYPE_COMMAND, "expr type");
@@ -834,5 +980,8 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_chunked_script();
+	test_empty_string();
+	test_reserve_commit();
 	return 0;
 }
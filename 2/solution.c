@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +42,70 @@ void execute_base_command(const struct expr *e) {
   execvp(e->cmd.exe, args_for_execvp);
 }
 
+/**
+ * Open the file the line's output is redirected to.
+ * @retval >=0 The descriptor, closed on exec.
+ * @retval -1 Error, errno is set.
+ */
+static int open_out_file(const struct command_line *line) {
+  int flags = O_CREAT | O_WRONLY | O_CLOEXEC;
+  if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
+    flags |= O_APPEND;
+  } else {
+    flags |= O_TRUNC;
+  }
+  return open(line->out_file, flags, 0664);
+}
+
+extern char **environ;
+
+/**
+ * Start an external command without fork(). posix_spawnp() doesn't
+ * copy the page tables of the shell - glibc starts the child in the
+ * shell's memory, like vfork(). The stdin and stdout descriptors are
+ * set up by the file actions in the child.
+ * @param in_fd Pipe to read stdin from, 0 - the shell's stdin.
+ * @param out_fd Pipe or file to write stdout to, 0 - the shell's
+ *        stdout.
+ * @param other_fd The other end of the out_fd pipe, closed in the
+ *        child. -1, if out_fd is not a pipe.
+ * @retval >0 Pid of the child.
+ * @retval -1 Error, errno is set.
+ */
+static pid_t spawn_command(const struct expr *e, int in_fd, int out_fd,
+                           int other_fd) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (in_fd != 0) {
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&actions, in_fd);
+  }
+  if (other_fd >= 0) {
+    posix_spawn_file_actions_addclose(&actions, other_fd);
+  }
+  if (out_fd != 0) {
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, out_fd);
+  }
+
+  char *args_for_exec[e->cmd.arg_count + 2];
+  args_for_exec[0] = e->cmd.exe;
+  for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+    args_for_exec[i + 1] = e->cmd.args[i];
+  }
+  args_for_exec[e->cmd.arg_count + 1] = NULL;
+
+  pid_t pid;
+  int rc = posix_spawnp(&pid, e->cmd.exe, &actions, NULL, args_for_exec,
+                        environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  return pid;
+}
+
 static int execute_command_line(const struct command_line *line) {
   int last_status = 0;
 
@@ -77,9 +143,50 @@ static int execute_command_line(const struct command_line *line) {
         return last_status;
       } else if (!strcmp(e->cmd.exe, "cd")) {
         execute_cd(e);
+      } else if (strcmp(e->cmd.exe, "exit") != 0) {
+        // Любые другие команды
+        bool is_piped = e->next && e->next->type == EXPR_TYPE_PIPE;
+        int out_fd = 0;
+        if (is_piped) {
+          out_fd = pipe_fd[1];
+        } else if (line->out_type != OUTPUT_TYPE_STDOUT) {
+          // Открываем в шелле, чтобы ошибка была про файл, а не команду
+          out_fd = open_out_file(line);
+        }
+
+        /* Not a child pid, wait() never returns it. */
+        last_pid = 0;
+        if (out_fd < 0) {
+          fprintf(stderr, "%s: %s\n", line->out_file, strerror(errno));
+          last_status = 1;
+        } else {
+          last_pid = spawn_command(e, use_pipe_as_stdin, out_fd,
+                                   is_piped ? pipe_fd[0] : -1);
+          if (last_pid < 0) {
+            fprintf(stderr, "%s: %s\n", e->cmd.exe, strerror(errno));
+            last_pid = 0;
+            last_status = 127;
+          } else {
+            proc_to_wait++;
+          }
+        }
+
+        if (!is_piped && out_fd > 0) {
+          close(out_fd);
+        }
+
+        if (use_pipe_as_stdin) {
+          close(use_pipe_as_stdin);
+          use_pipe_as_stdin = 0;
+        }
+
+        if (is_piped) {
+          use_pipe_as_stdin = pipe_fd[0];
+          close(pipe_fd[1]);
+        }
       } else {
+        // exit не последней командой - выходит только процесс конвейера
         last_pid = fork();
-        // Любые другие команды
         if (last_pid == 0) {
           // Тюним а точно ли читаем из STDIN
           if (use_pipe_as_stdin != 0) {
@@ -90,15 +197,15 @@ static int execute_command_line(const struct command_line *line) {
 
           // Тюним куда хотим выводить
           int fd = STDOUT_FILENO;
-          if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-            fd = open(line->out_file, O_APPEND | O_RDWR | O_APPEND, 0664);
-          }
-          if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-            fd = open(line->out_file, O_CREAT | O_WRONLY | O_TRUNC, 0664);
-          }
           if (e->next && e->next->type == EXPR_TYPE_PIPE) {
             close(pipe_fd[0]);
             fd = pipe_fd[1];
+          } else if (line->out_type != OUTPUT_TYPE_STDOUT) {
+            fd = open_out_file(line);
+            if (fd < 0) {
+              fprintf(stderr, "%s: %s\n", line->out_file, strerror(errno));
+              exit(1);
+            }
           }
 
           if (fd != STDOUT_FILENO) {
@@ -147,11 +254,14 @@ int main(void) {
   setvbuf(stdout, NULL, _IONBF, 0);
   int last_status = 0;
   const size_t buf_size = 1024;
-  char buf[buf_size];
   int rc;
   struct parser *p = parser_new();
-  while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
-    parser_feed(p, buf, rc);
+  while (true) {
+    /* Read straight into the parser's buffer. */
+    char *buf = parser_reserve(p, buf_size);
+    if ((rc = read(STDIN_FILENO, buf, buf_size)) <= 0)
+      break;
+    parser_commit(p, rc);
     struct command_line *line = NULL;
     while (true) {
       enum parser_error err = parser_pop_next(p, &line);
@@ -0,0 +1,106 @@
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Command launch benchmark: fork() + execvp() against posix_spawnp(),
+ * like the shell starts its commands. Each launch starts `true` and
+ * waits for it. The shell's memory is grown between the rounds, since
+ * fork() has to copy the page tables of all of it, and spawn doesn't.
+ *
+ * Usage: spawn_bench [max RSS in MB, default 1024]
+ */
+
+enum { LAUNCH_COUNT = 1000 };
+enum { RUN_COUNT = 3 };
+
+extern char **environ;
+
+static char *true_argv[] = {"true", NULL};
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static pid_t
+launch_fork(void)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		execvp(true_argv[0], true_argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+static pid_t
+launch_spawn(void)
+{
+	pid_t pid;
+	if (posix_spawnp(&pid, true_argv[0], NULL, NULL, true_argv,
+			 environ) != 0)
+		return -1;
+	return pid;
+}
+
+/** Best of the runs, in commands per second. */
+static double
+measure(pid_t (*launch)(void))
+{
+	double best = 0;
+	for (int run = 0; run < RUN_COUNT; ++run) {
+		long long start = now_ns();
+		for (int i = 0; i < LAUNCH_COUNT; ++i) {
+			pid_t pid = launch();
+			if (pid < 0) {
+				perror("launch");
+				exit(1);
+			}
+			waitpid(pid, NULL, 0);
+		}
+		double rate = LAUNCH_COUNT / ((now_ns() - start) / 1e9);
+		if (rate > best)
+			best = rate;
+	}
+	return best;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t max_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+	printf("%d launches of `true`, best of %d runs\n", LAUNCH_COUNT,
+	       RUN_COUNT);
+	printf("%8s %14s %14s\n", "RSS, MB", "fork, cmd/s", "spawn, cmd/s");
+	char *mem = NULL;
+	size_t mb = 0;
+	while (true) {
+		double fork_rate = measure(launch_fork);
+		double spawn_rate = measure(launch_spawn);
+		printf("%8zu %14.0f %14.0f\n", mb, fork_rate, spawn_rate);
+		if (mb >= max_mb)
+			break;
+		free(mem);
+		mb = mb == 0 ? 64 : mb * 4;
+		if (mb > max_mb)
+			mb = max_mb;
+		mem = malloc(mb * 1024 * 1024);
+		if (mem == NULL) {
+			perror("malloc");
+			return 1;
+		}
+		/* Touch every page to have it really mapped. */
+		memset(mem, 1, mb * 1024 * 1024);
+	}
+	free(mem);
+	return 0;
+}